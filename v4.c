@@ -1,3 +1,5 @@
+// build: gcc v4.c -o v4 -lreadline -lz -pthread
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -6,6 +8,25 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <locale.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 // livraries to provide command line history and editing features
 #include <readline/readline.h>   
 #include <readline/history.h>
@@ -15,94 +36,990 @@
 #define ARGLEN 30
 #define PROMPT "NewShell@/home/new/:- "
 #define HISTORY_SIZE 10
+#define GETDENTS_BUF_SIZE (256 * 1024)  // big enough to read most directories in a few syscalls
+#define TRACE_RING_SIZE 8192             // must be a power of two
+#define MAX_JOBS 100
+#define JOB_BUFFER_SIZE (64 * 1024)      // output kept in memory per background job
+#define PIPEMON_INTERVAL_MS 250          // set -o pipemon sampling period
+
+// growable list of strings (used for glob results)
+typedef struct {
+    char** items;
+    int count;
+    int cap;
+} StrVec;
+
+// one timed phase; seq is written last so readers can skip half-written slots
+typedef struct {
+    unsigned long seq;
+    const char* name;
+    long long start_ns;
+    long long end_ns;
+    int pid;
+} TraceEvent;
+
+typedef struct {
+    unsigned long head;   // total number of events ever claimed
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+TraceRing* trace_ring = NULL;  // shared with children, mapped on first use
+int trace_enabled = 0;
+int last_status = 0;           // exit status of the last foreground command
+int zygote_fd = -1;            // socket to the zygote, -1 if there is none
+
+// a background job; its stdout/stderr go to a pipe that the capture thread
+// drains into a bounded ring buffer (older bytes optionally spill to a .gz file)
+typedef struct {
+    int id;                      // 0 = free slot, -1 = reserved by job_reserve()
+    pid_t pid;
+    char command[MAX_LEN];
+    int out_fd;                  // read end of the output pipe, -1 once at EOF
+    char* buf;                   // ring buffer of JOB_BUFFER_SIZE bytes
+    size_t start;
+    size_t len;
+    unsigned long long total;    // bytes ever written by the job
+    int spill_enabled;           // job-spill was on when the job started
+    gzFile spill;                // bytes pushed out of the ring
+    char spill_path[64];
+    volatile sig_atomic_t done;  // set by the SIGCHLD handler
+    volatile int status;
+    int reported;
+} Job;
+
+Job jobs[MAX_JOBS];
+int next_job_id = 1;
+int job_spill = 0;               // set -o job-spill
+int pipemon = 0;                 // set -o pipemon
+char** command_env = NULL;       // NAME=value words in front of the command
+int command_env_len = 0;         // being started, for spawn() to export
+int expand_error = 0;            // an arithmetic expansion failed
+pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_t capture_tid;
+int capture_wake[2] = { -1, -1 };
+
+// the shell's own stdin/stdout while a builtin or command runs redirected
+typedef struct {
+    int saved[2];         // dups of the original fd 0 and 1, or -1
+    int reader_owned;     // stdin_reader.owned before stdin was replaced
+} Redirect;
+
+// options toggled with set -o / set +o
+typedef struct {
+    const char* name;
+    int* flag;
+} ShellOption;
+
+ShellOption shell_options[] = {
+    { "trace-perf", &trace_enabled },
+    { "job-spill", &job_spill },
+    { "pipemon", &pipemon },
+    { NULL, NULL }
+};
 
 int execute(char* arglist[], int background);
+pid_t spawn(char** arglist, int in_fd, int out_fd, int err_fd);
 char** tokenize(char* cmdline);
 char* read_cmd(char* prompt);
-void handle_redirection(char **arglist);
+int handle_redirection(char **arglist, Redirect* r);
+void restore_redirection(Redirect* r);
 int handle_pipes(char *cmdline);
 void sigchld_handler(int sig);
 char* get_history_command(int index);
+int has_glob_meta(const char* word);
+int expand_glob(const char* word, StrVec* out);
+void glob_cache_clear(void);
+void strvec_push(StrVec* v, char* s);
+int execute_builtin(char** arglist);
+void trace_init(void);
+void trace_map(void);
+long long trace_now(void);
+void trace_event(const char* name, long long start_ns, long long end_ns);
+int trace_dump(const char* path);
+void exec_traced(char** arglist);
+Job* job_reserve(void);
+Job* find_job(int id);
+Job* job_start(Job* job, pid_t pid, char** arglist, int out_fd);
+void report_finished_jobs(void);
+void list_jobs(void);
+void jobs_cleanup(void);
+int print_job_output(int id, int last_lines);
+void run_on(char** arglist);
+void run_watch(char* line);
+int run_command_line(char* cmdline);
+int run_server(const char* path);
+void zygote_init(void);
+int zygote_run(char** arglist);
+void zygote_bench(int runs, int heap_mb);
+char* expand_vars(const char* word);
+void free_arglist(char** arglist);
+const char* skip_expansion(const char* p);
+void buf_append(char** out, size_t* n, size_t* cap, const char* s, size_t len);
+int arith_eval(const char* expr, long long* result);
+char* expand_param(const char* inner);
+const char* get_var(const char* name);
+unsigned int hash_str(const char* s);
+void set_var(const char* name, const char* value);
+void set_assignments(char** words, int n, char** saved);
+void restore_assignments(char** words, int n, char** saved);
+int is_assignment(const char* word);
+void read_sync(void);
+void before_fork(void);
+void builtin_read(char** arglist);
+int run_while(char* line);
+int read_set_owned(int owned);
+int monitor_pipeline(pid_t* pids, char (*names)[24], int n, int* read_fds);
 
-int main() {
+int main(int argc, char* argv[]) {
     char *cmdline;
     char* prompt = PROMPT;
 
+    // glob results are sorted with strcoll(), so honour the user's collation order
+    setlocale(LC_COLLATE, "");
+
+    // SHELL_TRACE_PERF=1 turns tracing on from the start (same as set -o trace-perf)
+    trace_init();
+
     // Set up the SIGCHLD handler to reap background processes
     signal(SIGCHLD, sigchld_handler);
 
+    // --server [socket]: serve command lines sent by v4_client instead of reading a terminal
+    if (argc > 1 && strcmp(argv[1], "--server") == 0)
+        return run_server(argc > 2 ? argv[2] : NULL);
+
+    // SHELL_ZYGOTE=N: fork the launch helper now, before history and friends grow the heap
+    zygote_init();
+
     // Initialize history file and set maximum history size
     using_history();
     stifle_history(HISTORY_SIZE);  // 10 here
 
-    while ((cmdline = read_cmd(prompt)) != NULL) {
-        if (handle_pipes(cmdline) == 1) {
-            free(cmdline);
-            continue;
-        }
+    while (1) {
+        report_finished_jobs();
+        long long t0 = trace_now();
+        cmdline = read_cmd(prompt);
+        trace_event("read_cmd", t0, trace_now());
+        if (cmdline == NULL)
+            break;
+
+        run_command_line(cmdline);
+        free(cmdline);
+    }
+    printf("\n");
+    jobs_cleanup();
+    return 0;
+}
 
-        char** arglist = tokenize(cmdline);
-        if (arglist != NULL) {
-            int background = 0;
+// runs one command line (pipeline, builtin or simple command); cmdline is
+// modified. Returns the exit status, which is also kept in last_status
+int run_command_line(char* cmdline) {
+    while (isspace((unsigned char)*cmdline))
+        cmdline++;
+    if (strncmp(cmdline, "while", 5) == 0 && isspace((unsigned char)cmdline[5]))
+        return run_while(cmdline + 5);
 
-            // Check if the last argument is "&" for background execution
-            for (int i = 0; arglist[i] != NULL; i++) {
-                if (strcmp(arglist[i], "&") == 0 && arglist[i + 1] == NULL) {
-                    background = 1;
-                    free(arglist[i]);  // Free the "&" token
-                    arglist[i] = NULL; // Set last argument to NULL
-                    break;
-                }
-            }
+    // watch takes a whole pipeline, so it has to see the line before it is split on '|'
+    if (strncmp(cmdline, "watch", 5) == 0 && (cmdline[5] == '\0' || isspace((unsigned char)cmdline[5]))) {
+        run_watch(cmdline + 5);
+        return last_status = 0;
+    }
 
-            handle_redirection(arglist);
-            execute(arglist, background);
+    if (handle_pipes(cmdline) == 1) {
+        glob_cache_clear();
+        return last_status;
+    }
+
+    long long t0 = trace_now();
+    char** arglist = tokenize(cmdline);
+    trace_event("tokenize", t0, trace_now());
+    if (arglist != NULL) {
+        int background = 0;
+
+        // Check if the last argument is "&" for background execution
+        for (int i = 0; arglist[i] != NULL; i++) {
+            if (strcmp(arglist[i], "&") == 0 && arglist[i + 1] == NULL) {
+                background = 1;
+                free(arglist[i]);  // Free the "&" token
+                arglist[i] = NULL; // Set last argument to NULL
+                break;
+            }
+        }
 
-            // Free allocated memory
-            for (int j = 0; j < MAXARGS + 1; j++)
-                free(arglist[j]);
-            free(arglist);
-            free(cmdline);
+        last_status = 0;
+        int nassign = 0;
+        while (arglist[nassign] != NULL && is_assignment(arglist[nassign]))
+            nassign++;
+        if (nassign > 0 && arglist[nassign] == NULL) {
+            // NAME=value ...: only assignments on the line, so set shell variables
+            set_assignments(arglist, nassign, NULL);
+        } else if (arglist[0] != NULL) {
+            // builtins run in the shell itself, so "< file" and "> file" are
+            // applied to the shell's own stdin/stdout and undone afterwards
+            char** cmd = arglist + nassign;
+            Redirect redir;
+            t0 = trace_now();
+            int ok = handle_redirection(cmd, &redir) == 0;
+            trace_event("handle_redirection", t0, trace_now());
+            if (!ok) {
+                last_status = 1;
+            } else if (cmd[0] != NULL) {
+                // NAME=value in front of a command is for that command only:
+                // a builtin sees it as a shell variable, anything else in
+                // its environment
+                char* saved[nassign + 1];
+                set_assignments(arglist, nassign, saved);
+                int ran = execute_builtin(cmd);
+                restore_assignments(arglist, nassign, saved);
+                if (!ran) {
+                    command_env = arglist;
+                    command_env_len = nassign;
+                    execute(cmd, background);
+                    command_env_len = 0;
+                }
+            }
+            restore_redirection(&redir);
         }
+
+        // Free allocated memory (tokenize() may return more than MAXARGS words after globbing)
+        free_arglist(arglist);
+        glob_cache_clear();  // directory listings are only trusted for one command
+    } else {
+        last_status = 1;
     }
-    printf("\n");
-    return 0;
+    return last_status;
 }
 
 int execute(char* arglist[], int background) {
     int status;
-    int cpid = fork();
+    int outpipe[2] = { -1, -1 };
+
+    // foreground commands go through the zygote when there is one (it was
+    // forked with the startup environment, so not with NAME=value prefixes)
+    if (!background && zygote_fd != -1 && command_env_len == 0 && (status = zygote_run(arglist)) != -1) {
+        last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        return last_status;
+    }
+
+    // a background job needs a slot in the job table; without one it still
+    // runs, just untracked and writing straight to the terminal
+    Job* job = NULL;
+    if (background && (job = job_reserve()) == NULL)
+        fprintf(stderr, "jobs: too many jobs, this one is not tracked\n");
+
+    // capture background output only when it would otherwise land on the
+    // terminal; a redirected stdout is left alone
+    if (job != NULL && isatty(STDOUT_FILENO) && pipe2(outpipe, O_CLOEXEC) == -1) {
+        perror("pipe failed");
+        outpipe[0] = outpipe[1] = -1;
+    }
+
+    // hold SIGCHLD until a background job is in the job table (otherwise a
+    // quick job could be reaped before anyone knows it was a job), or until
+    // a foreground command has been waited for
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    int cpid = spawn(arglist, -1, outpipe[1], outpipe[1]);
     switch (cpid) {
         case -1:
             perror("fork failed");
             exit(1);
-        case 0:
-            execvp(arglist[0], arglist);
-            perror("Command not found...");
-            exit(1);
         default:
             if (!background) {
                 // Wait for the process if it's not running in the background
-                waitpid(cpid, &status, 0);
+                long long t0 = trace_now();
+                if (waitpid(cpid, &status, 0) == -1)
+                    status = 1 << 8;
+                trace_event("waitpid", t0, trace_now());
+                sigprocmask(SIG_SETMASK, &old, NULL);
+                last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
             } else {
-                printf("[1] %d\n", cpid);  // Print background process ID
+                if (outpipe[1] != -1)
+                    close(outpipe[1]);
+                job = job_start(job, cpid, arglist, outpipe[0]);
+                sigprocmask(SIG_SETMASK, &old, NULL);
+                printf("[%d] %d\n", job ? job->id : 0, cpid);  // Print job number and process ID
+                last_status = 0;
             }
-            return 0;
+            return last_status;
     }
 }
 
+// forks and execs arglist with stdin/stdout/stderr optionally replaced (-1
+// keeps the shell's); returns the child's pid, or -1 if fork failed
+pid_t spawn(char** arglist, int in_fd, int out_fd, int err_fd) {
+    before_fork();
+    long long t0 = trace_now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // how long it took from fork() in the parent until the child got the CPU
+        trace_event("child_start", t0, trace_now());
+        sigset_t chld;
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &chld, NULL);
+        if (in_fd != -1)
+            dup2(in_fd, STDIN_FILENO);
+        if (out_fd != -1)
+            dup2(out_fd, STDOUT_FILENO);
+        if (err_fd != -1)
+            dup2(err_fd, STDERR_FILENO);
+        for (int i = 0; i < command_env_len; i++)
+            putenv(command_env[i]);
+        exec_traced(arglist);
+        perror("Command not found...");
+        exit(1);
+    }
+    if (pid > 0)
+        trace_event("fork", t0, trace_now());
+    return pid;
+}
+
+// splits the command line on whitespace, expands variables, arithmetic and
+// glob patterns (*, ?, [...], **); a pattern that matches nothing is passed
+// through unchanged, like sh does. Returns NULL if an arithmetic expansion
+// failed (the error has been printed)
 char** tokenize(char* cmdline) {
-    char** arglist = (char**)malloc(sizeof(char*) * (MAXARGS + 1));
-    int argnum = 0;
-    char* token = strtok(cmdline, " \t\n");
+    StrVec args = { NULL, 0, 0 };
+    char* p = cmdline;
+    expand_error = 0;
+
+    while (1) {
+        // split on whitespace, but not inside ${...} or $((...))
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0')
+            break;
+        char* token = p;
+        while (*p && !isspace((unsigned char)*p)) {
+            const char* end = skip_expansion(p);
+            p = end > p ? (char*)end : p + 1;
+        }
+        if (*p)
+            *p++ = '\0';
+
+        char* word = expand_vars(token);
+        // a word that expanded to nothing disappears, as in sh
+        if (*word == '\0' && strchr(token, '$') != NULL) {
+            free(word);
+        } else if (!has_glob_meta(word) || expand_glob(word, &args) == 0) {
+            strvec_push(&args, word);
+        } else {
+            free(word);
+        }
+    }
+    strvec_push(&args, NULL);
+    if (expand_error) {
+        free_arglist(args.items);
+        return NULL;
+    }
+    return args.items;
+}
+
+void free_arglist(char** arglist) {
+    for (int i = 0; arglist[i] != NULL; i++)
+        free(arglist[i]);
+    free(arglist);
+}
+
+// ---------------------------------------------------------------------------
+// shell variables
+//
+// Kept in a small hash table of our own rather than with setenv(): glibc
+// never frees old setenv() strings, so a loop assigning a million values
+// would keep all of them. Lookups fall back to the environment, and shell
+// variables are not exported to commands.
+// ---------------------------------------------------------------------------
+
+#define VAR_BUCKETS 64
+
+typedef struct ShellVar {
+    char* name;
+    char* value;
+    size_t cap;             // bytes allocated for value
+    struct ShellVar* next;
+} ShellVar;
+
+ShellVar* shell_vars[VAR_BUCKETS];
+
+ShellVar* find_var(const char* name, int create) {
+    unsigned int h = hash_str(name) % VAR_BUCKETS;
+    for (ShellVar* v = shell_vars[h]; v != NULL; v = v->next) {
+        if (strcmp(v->name, name) == 0)
+            return v;
+    }
+    if (!create)
+        return NULL;
+    ShellVar* v = calloc(1, sizeof(ShellVar));
+    v->name = strdup(name);
+    v->next = shell_vars[h];
+    shell_vars[h] = v;
+    return v;
+}
+
+const char* get_var(const char* name) {
+    ShellVar* v = find_var(name, 0);
+    return v != NULL ? v->value : getenv(name);
+}
+
+int is_assignment(const char* word) {
+    if (!isalpha((unsigned char)*word) && *word != '_')
+        return 0;
+    while (isalnum((unsigned char)*word) || *word == '_')
+        word++;
+    return *word == '=';
+}
+
+// drops a shell variable; the environment's value (if any) shows again
+void unset_var(const char* name) {
+    unsigned int h = hash_str(name) % VAR_BUCKETS;
+    for (ShellVar** v = &shell_vars[h]; *v != NULL; v = &(*v)->next) {
+        if (strcmp((*v)->name, name) == 0) {
+            ShellVar* gone = *v;
+            *v = gone->next;
+            free(gone->name);
+            free(gone->value);
+            free(gone);
+            return;
+        }
+    }
+}
+
+// sets the NAME=value words; with saved != NULL the old values are kept
+// there (strdup'ed, NULL if unset) for restore_assignments()
+void set_assignments(char** words, int n, char** saved) {
+    for (int i = 0; i < n; i++) {
+        char* eq = strchr(words[i], '=');
+        *eq = '\0';
+        if (saved != NULL) {
+            ShellVar* v = find_var(words[i], 0);
+            saved[i] = v != NULL ? strdup(v->value) : NULL;
+        }
+        set_var(words[i], eq + 1);
+        *eq = '=';
+    }
+}
+
+void restore_assignments(char** words, int n, char** saved) {
+    // backwards, so NAME=1 NAME=2 ends up with the value from before both
+    for (int i = n - 1; i >= 0; i--) {
+        char* eq = strchr(words[i], '=');
+        *eq = '\0';
+        if (saved[i] != NULL)
+            set_var(words[i], saved[i]);
+        else
+            unset_var(words[i]);
+        *eq = '=';
+        free(saved[i]);
+    }
+}
+
+void set_var(const char* name, const char* value) {
+    ShellVar* v = find_var(name, 1);
+    size_t len = strlen(value) + 1;
+    if (len > v->cap)
+        v->value = realloc(v->value, v->cap = len < 32 ? 32 : len);
+    memcpy(v->value, value, len);
+}
+
+// returns the end of the $((...)) or ${...} that starts at p, or p itself
+// if there is none; lets the splitters keep "$(( i + 1 ))" in one piece
+const char* skip_expansion(const char* p) {
+    if (p[0] != '$' || (p[1] != '{' && p[1] != '('))
+        return p;
+    char open = p[1], close = (open == '{') ? '}' : ')';
+    int depth = 0;
+    for (const char* q = p + 1; *q; q++) {
+        if (*q == open) {
+            depth++;
+        } else if (*q == close && --depth == 0) {
+            return q + 1;
+        }
+    }
+    return p;  // unterminated, treat it as ordinary text
+}
+
+// replaces $name, $?, ${...} and $((...)) in word; returns a new string
+char* expand_vars(const char* word) {
+    if (strchr(word, '$') == NULL)
+        return strdup(word);
+
+    size_t cap = strlen(word) + 64, n = 0;
+    char* out = malloc(cap);
+    out[0] = '\0';
+    for (const char* p = word; *p;) {
+        const char* end = skip_expansion(p);
+        char num[32];
+        if (end > p && p[1] == '(' && p[2] == '(' && end[-2] == ')') {
+            char* expr = strndup(p + 3, end - p - 5);
+            char* e = expand_vars(expr);
+            long long value;
+            if (expand_error) {
+                // an inner expansion failed and has said so
+            } else if (arith_eval(e, &value) == 0) {
+                snprintf(num, sizeof(num), "%lld", value);
+                buf_append(&out, &n, &cap, num, strlen(num));
+            } else {
+                expand_error = 1;
+            }
+            free(e);
+            free(expr);
+            p = end;
+        } else if (end > p && p[1] == '{') {
+            char* inner = strndup(p + 2, end - p - 3);
+            char* value = expand_param(inner);
+            buf_append(&out, &n, &cap, value, strlen(value));
+            free(value);
+            free(inner);
+            p = end;
+        } else if (p[0] == '$' && p[1] == '?') {
+            snprintf(num, sizeof(num), "%d", last_status);
+            buf_append(&out, &n, &cap, num, strlen(num));
+            p += 2;
+        } else if (p[0] == '$' && (isalpha((unsigned char)p[1]) || p[1] == '_')) {
+            const char* name = p + 1;
+            size_t len = 0;
+            while (isalnum((unsigned char)name[len]) || name[len] == '_')
+                len++;
+            char var[256];
+            snprintf(var, sizeof(var), "%.*s", (int)len, name);
+            const char* value = get_var(var);
+            if (value != NULL)
+                buf_append(&out, &n, &cap, value, strlen(value));
+            p = name + len;
+        } else {
+            buf_append(&out, &n, &cap, p, 1);
+            p++;
+        }
+    }
+    return out;
+}
+
+void strvec_push(StrVec* v, char* s) {
+    if (v->count == v->cap) {
+        v->cap = v->cap ? v->cap * 2 : MAXARGS + 1;
+        v->items = realloc(v->items, sizeof(char*) * v->cap);
+    }
+    v->items[v->count++] = s;
+}
+
+// ---------------------------------------------------------------------------
+// glob expansion
+//
+// Directories are read with getdents64 straight into one big buffer and kept
+// in a cache until the current command finishes, so "*/x" and "**" never list
+// the same directory twice. Each path segment is compiled once into a small
+// op list; matching an entry is then a memcmp/bitmap walk instead of a full
+// fnmatch() parse per file.
+// ---------------------------------------------------------------------------
+
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// one directory listing, names packed back to back in a single buffer
+typedef struct {
+    char* path;
+    unsigned int hash;
+    char* names;
+    int* offsets;
+    int* lengths;
+    unsigned char* types;
+    int count;
+} DirListing;
+
+DirListing** dir_cache = NULL;
+int dir_cache_count = 0;
+int dir_cache_cap = 0;
+
+enum { PAT_LITERAL, PAT_ANY, PAT_STAR, PAT_CLASS };
+
+typedef struct {
+    int type;
+    int len;                 // PAT_LITERAL: number of bytes
+    const char* lit;         // PAT_LITERAL: points into Pattern.buf
+    unsigned char set[32];   // PAT_CLASS: one bit per byte value
+} PatOp;
+
+// compiled form of one path segment
+typedef struct {
+    PatOp* ops;
+    int nops;
+    char* buf;               // unescaped literal bytes
+    int min_len;             // bytes every match must have
+    int suffix_len;          // trailing literal after the last '*' (quick reject)
+    const char* suffix;
+    int leading_dot;         // pattern starts with a literal '.'
+} Pattern;
+
+unsigned int hash_str(const char* s) {
+    unsigned int h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+int has_glob_meta(const char* word) {
+    for (const char* p = word; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '*' || *p == '?' || *p == '[') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void glob_cache_clear(void) {
+    for (int i = 0; i < dir_cache_count; i++) {
+        DirListing* d = dir_cache[i];
+        free(d->path);
+        free(d->names);
+        free(d->offsets);
+        free(d->lengths);
+        free(d->types);
+        free(d);
+    }
+    dir_cache_count = 0;
+}
+
+// returns the (cached) listing of path, or NULL if it can't be opened
+DirListing* list_directory(const char* path) {
+    static char buf[GETDENTS_BUF_SIZE];
+    unsigned int h = hash_str(path);
+
+    for (int i = 0; i < dir_cache_count; i++) {
+        if (dir_cache[i]->hash == h && strcmp(dir_cache[i]->path, path) == 0)
+            return dir_cache[i];
+    }
+
+    int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    DirListing* d = calloc(1, sizeof(DirListing));
+    int names_len = 0, names_cap = 0, cap = 0;
+    long nread;
+
+    while ((nread = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long pos = 0; pos < nread;) {
+            struct linux_dirent64* e = (struct linux_dirent64*)(buf + pos);
+            pos += e->d_reclen;
+
+            const char* name = e->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+
+            int len = strlen(name);
+            if (names_len + len + 1 > names_cap) {
+                names_cap = names_cap ? names_cap * 2 : 4096;
+                while (names_len + len + 1 > names_cap)
+                    names_cap *= 2;
+                d->names = realloc(d->names, names_cap);
+            }
+            if (d->count == cap) {
+                cap = cap ? cap * 2 : 64;
+                d->offsets = realloc(d->offsets, sizeof(int) * cap);
+                d->lengths = realloc(d->lengths, sizeof(int) * cap);
+                d->types = realloc(d->types, cap);
+            }
+            memcpy(d->names + names_len, name, len + 1);
+            d->offsets[d->count] = names_len;
+            d->lengths[d->count] = len;
+            d->types[d->count] = e->d_type;
+            d->count++;
+            names_len += len + 1;
+        }
+    }
+    close(fd);
+
+    d->path = strdup(path);
+    d->hash = h;
+    if (dir_cache_count == dir_cache_cap) {
+        dir_cache_cap = dir_cache_cap ? dir_cache_cap * 2 : 16;
+        dir_cache = realloc(dir_cache, sizeof(DirListing*) * dir_cache_cap);
+    }
+    dir_cache[dir_cache_count++] = d;
+    return d;
+}
+
+// compiles one path segment (no '/') into a Pattern
+void pattern_compile(Pattern* p, const char* seg) {
+    int n = strlen(seg);
+    p->ops = malloc(sizeof(PatOp) * (n + 1));
+    p->buf = malloc(n + 1);
+    p->nops = 0;
+    p->min_len = 0;
+    p->leading_dot = (seg[0] == '.' || (seg[0] == '\\' && seg[1] == '.'));
+
+    int blen = 0;
+    for (int i = 0; i < n;) {
+        PatOp* op = &p->ops[p->nops];
+        if (seg[i] == '*') {
+            while (seg[i] == '*')
+                i++;
+            op->type = PAT_STAR;
+            p->nops++;
+            continue;
+        }
+        if (seg[i] == '?') {
+            op->type = PAT_ANY;
+            p->nops++;
+            p->min_len++;
+            i++;
+            continue;
+        }
+        if (seg[i] == '[') {
+            int j = i + 1, negate = 0;
+            if (seg[j] == '!' || seg[j] == '^') {
+                negate = 1;
+                j++;
+            }
+            int start = j;
+            while (seg[j] && (seg[j] != ']' || j == start))
+                j++;
+            if (seg[j] == ']') {
+                memset(op->set, 0, sizeof(op->set));
+                for (int k = start; k < j; k++) {
+                    unsigned char lo = seg[k], hi = seg[k];
+                    if (seg[k + 1] == '-' && k + 2 < j) {
+                        hi = seg[k + 2];
+                        k += 2;
+                    }
+                    for (int c = lo; c <= hi; c++)
+                        op->set[c >> 3] |= 1 << (c & 7);
+                }
+                if (negate) {
+                    for (int k = 0; k < 32; k++)
+                        op->set[k] = ~op->set[k];
+                }
+                op->set[0] &= ~1;  // never match the terminating NUL
+                op->type = PAT_CLASS;
+                p->nops++;
+                p->min_len++;
+                i = j + 1;
+                continue;
+            }
+            // no closing ']': treat '[' as an ordinary character
+        }
+
+        // literal run, merged with the previous op if that was a literal too
+        if (seg[i] == '\\' && seg[i + 1])
+            i++;
+        if (p->nops > 0 && p->ops[p->nops - 1].type == PAT_LITERAL) {
+            p->ops[p->nops - 1].len++;
+        } else {
+            op->type = PAT_LITERAL;
+            op->lit = p->buf + blen;
+            op->len = 1;
+            p->nops++;
+        }
+        p->buf[blen++] = seg[i++];
+        p->min_len++;
+    }
+
+    p->suffix_len = 0;
+    p->suffix = NULL;
+    if (p->nops >= 2 && p->ops[p->nops - 1].type == PAT_LITERAL) {
+        p->suffix = p->ops[p->nops - 1].lit;
+        p->suffix_len = p->ops[p->nops - 1].len;
+    }
+}
+
+void pattern_free(Pattern* p) {
+    free(p->ops);
+    free(p->buf);
+}
+
+int pattern_match(const Pattern* p, const char* s, int len) {
+    if (len < p->min_len)
+        return 0;
+    if (s[0] == '.' && !p->leading_dot)
+        return 0;  // hidden files only match an explicit leading dot
+    if (p->suffix_len && memcmp(s + len - p->suffix_len, p->suffix, p->suffix_len) != 0)
+        return 0;
+
+    // every op except '*' consumes a fixed number of bytes, so remembering
+    // only the most recent '*' is enough to backtrack correctly
+    int oi = 0, si = 0, star_oi = -1, star_si = 0;
+    while (si < len) {
+        if (oi < p->nops) {
+            const PatOp* op = &p->ops[oi];
+            unsigned char c = s[si];
+            if (op->type == PAT_STAR) {
+                star_oi = ++oi;
+                star_si = si;
+                continue;
+            }
+            if (op->type == PAT_ANY ||
+                (op->type == PAT_CLASS && (op->set[c >> 3] & (1 << (c & 7))))) {
+                oi++;
+                si++;
+                continue;
+            }
+            if (op->type == PAT_LITERAL && si + op->len <= len &&
+                memcmp(s + si, op->lit, op->len) == 0) {
+                oi++;
+                si += op->len;
+                continue;
+            }
+        }
+        if (star_oi < 0)
+            return 0;
+        oi = star_oi;
+        si = ++star_si;
+    }
+    while (oi < p->nops && p->ops[oi].type == PAT_STAR)
+        oi++;
+    return oi == p->nops;
+}
+
+char* path_join(const char* dir, const char* name, int len) {
+    int dlen = strlen(dir);
+    int sep = (dlen > 0 && dir[dlen - 1] != '/');
+    char* s = malloc(dlen + sep + len + 1);
+    memcpy(s, dir, dlen);
+    if (sep)
+        s[dlen] = '/';
+    memcpy(s + dlen + sep, name, len);
+    s[dlen + sep + len] = '\0';
+    return s;
+}
+
+int entry_is_dir(const DirListing* d, int i, const char* full) {
+    struct stat st;
+    if (d->types[i] == DT_DIR)
+        return 1;
+    if (d->types[i] != DT_UNKNOWN && d->types[i] != DT_LNK)
+        return 0;
+    return stat(full, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// adds every non-hidden entry below dir; with dirs_only, only directories
+void walk_tree(const char* dir, int dirs_only, StrVec* out) {
+    DirListing* d = list_directory(dir);
+    if (d == NULL)
+        return;
+    for (int i = 0; i < d->count; i++) {
+        const char* name = d->names + d->offsets[i];
+        if (name[0] == '.')
+            continue;
+        char* full = path_join(dir, name, d->lengths[i]);
+        // ** does not descend through symlinks, so loops are impossible;
+        // lstat() because an untyped entry may itself be a symlink
+        struct stat st;
+        int is_dir = d->types[i] == DT_DIR ||
+                     (d->types[i] == DT_UNKNOWN && lstat(full, &st) == 0 && S_ISDIR(st.st_mode));
+        if (is_dir || !dirs_only)
+            strvec_push(out, strdup(full));
+        if (is_dir)
+            walk_tree(full, dirs_only, out);
+        free(full);
+    }
+}
+
+char* unescape(const char* s, int len) {
+    char* r = malloc(len + 1);
+    int n = 0;
+    for (int i = 0; i < len; i++) {
+        if (s[i] == '\\' && i + 1 < len)
+            i++;
+        r[n++] = s[i];
+    }
+    r[n] = '\0';
+    return r;
+}
+
+// strcoll() compares in place, unlike strxfrm() keys which need a copy per name
+int compare_paths(const void* a, const void* b) {
+    return strcoll(*(char* const*)a, *(char* const*)b);
+}
+
+// expands word segment by segment; appends the sorted matches to out and
+// returns how many there were
+int expand_glob(const char* word, StrVec* out) {
+    StrVec cur = { NULL, 0, 0 };
+    int check_exists = 0;
+
+    strvec_push(&cur, strdup(word[0] == '/' ? "/" : ""));
+
+    const char* seg = word;
+    while (*seg && cur.count > 0) {
+        while (*seg == '/')
+            seg++;
+        if (*seg == '\0')
+            break;
+        const char* end = strchr(seg, '/');
+        int len = end ? end - seg : (int)strlen(seg);
+        int last = (end == NULL || end[strspn(end, "/")] == '\0');
+        char* s = strndup(seg, len);
+        StrVec next = { NULL, 0, 0 };
+
+        if (!has_glob_meta(s)) {
+            char* lit = unescape(s, len);
+            for (int i = 0; i < cur.count; i++)
+                strvec_push(&next, path_join(cur.items[i], lit, strlen(lit)));
+            free(lit);
+            check_exists = 1;
+        } else if (strcmp(s, "**") == 0) {
+            // "**" matches zero or more directories (everything, when last)
+            for (int i = 0; i < cur.count; i++) {
+                if (!last)
+                    strvec_push(&next, strdup(cur.items[i]));
+                walk_tree(cur.items[i], !last, &next);
+            }
+            check_exists = 0;
+        } else {
+            Pattern pat;
+            pattern_compile(&pat, s);
+            for (int i = 0; i < cur.count; i++) {
+                DirListing* d = list_directory(cur.items[i]);
+                if (d == NULL)
+                    continue;
+                for (int j = 0; j < d->count; j++) {
+                    const char* name = d->names + d->offsets[j];
+                    if (!pattern_match(&pat, name, d->lengths[j]))
+                        continue;
+                    char* full = path_join(cur.items[i], name, d->lengths[j]);
+                    if (!last && !entry_is_dir(d, j, full)) {
+                        free(full);
+                        continue;
+                    }
+                    strvec_push(&next, full);
+                }
+            }
+            pattern_free(&pat);
+            check_exists = 0;
+        }
+
+        free(s);
+        for (int i = 0; i < cur.count; i++)
+            free(cur.items[i]);
+        free(cur.items);
+        cur = next;
+        seg += len;
+    }
 
-    while (token != NULL && argnum < MAXARGS) {
-        arglist[argnum] = strdup(token);
-        argnum++;
-        token = strtok(NULL, " \t\n");
+    int found = 0;
+    if (cur.count > 1)
+        qsort(cur.items, cur.count, sizeof(char*), compare_paths);
+    for (int i = 0; i < cur.count; i++) {
+        struct stat st;
+        if (cur.items[i][0] == '\0' || (check_exists && lstat(cur.items[i], &st) != 0)) {
+            free(cur.items[i]);
+            continue;
+        }
+        strvec_push(out, cur.items[i]);
+        found++;
     }
-    arglist[argnum] = NULL;
-    return arglist;
+    free(cur.items);
+    return found;
 }
 
 char* read_cmd(char* prompt) {
@@ -146,43 +1063,135 @@ char* get_history_command(int index) {
     }
 }
 
-void handle_redirection(char **arglist) {
+// applies "< file" and "> file" to the shell's stdin/stdout and removes
+// them from arglist; the old descriptors are kept in r for
+// restore_redirection(). Returns -1 if a file couldn't be opened
+int handle_redirection(char **arglist, Redirect* r) {
+    r->saved[0] = r->saved[1] = -1;
+    r->reader_owned = 0;
+    int error = 0, j = 0;
     for (int i = 0; arglist[i] != NULL; i++) {
-        if (strcmp(arglist[i], "<") == 0) {
-            int fd = open(arglist[i + 1], O_RDONLY);
-            if (fd == -1) {
-                perror("Failed to open input file");
-                exit(1);
-            }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
-            arglist[i] = NULL;
-        } else if (strcmp(arglist[i], ">") == 0) {
-            int fd = open(arglist[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd == -1) {
-                perror("Failed to open output file");
-                exit(1);
-            }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-            arglist[i] = NULL;
+        int target = strcmp(arglist[i], "<") == 0 ? STDIN_FILENO
+                   : strcmp(arglist[i], ">") == 0 ? STDOUT_FILENO : -1;
+        if (target == -1 || error) {
+            arglist[j++] = arglist[i];
+            continue;
+        }
+        if (arglist[i + 1] == NULL) {
+            fprintf(stderr, "%s: missing file name\n", arglist[i]);
+            error = 1;
+            arglist[j++] = arglist[i];
+            continue;
+        }
+        int fd = target == STDIN_FILENO
+               ? open(arglist[i + 1], O_RDONLY | O_CLOEXEC)
+               : open(arglist[i + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            perror(arglist[i + 1]);
+            error = 1;
+            arglist[j++] = arglist[i];
+            continue;
+        }
+        // nothing buffered for the old descriptor may end up in the new one
+        if (target == STDOUT_FILENO)
+            fflush(stdout);
+        if (r->saved[target] == -1) {
+            if (target == STDIN_FILENO)
+                r->reader_owned = read_set_owned(0);
+            r->saved[target] = fcntl(target, F_DUPFD_CLOEXEC, 10);
+        } else if (target == STDIN_FILENO) {
+            read_set_owned(0);
         }
+        dup2(fd, target);
+        close(fd);
+        free(arglist[i]);
+        free(arglist[++i]);
+    }
+    arglist[j] = NULL;
+    return error ? -1 : 0;
+}
+
+void restore_redirection(Redirect* r) {
+    if (r->saved[1] != -1) {
+        fflush(stdout);
+        dup2(r->saved[1], STDOUT_FILENO);
+        close(r->saved[1]);
+        r->saved[1] = -1;
+    }
+    if (r->saved[0] != -1) {
+        read_set_owned(0);  // drops what was buffered from the file
+        dup2(r->saved[0], STDIN_FILENO);
+        close(r->saved[0]);
+        r->saved[0] = -1;
+        read_set_owned(r->reader_owned);
     }
 }
 
 int handle_pipes(char *cmdline) {
     char* commands[MAXARGS];
-    char* token = strtok(cmdline, "|");
     int num_cmds = 0;
 
-    while (token != NULL && num_cmds < MAXARGS) {
-        commands[num_cmds++] = token;
-        token = strtok(NULL, "|");
+    // split on '|' (not inside ${...} or $((...))); empty segments are skipped
+    char* seg = cmdline;
+    char* p = cmdline;
+    while (num_cmds < MAXARGS) {
+        const char* end = skip_expansion(p);
+        if (end > p) {
+            p = (char*)end;
+            continue;
+        }
+        if (*p != '|' && *p != '\0') {
+            p++;
+            continue;
+        }
+        int last = (*p == '\0');
+        *p = '\0';
+        if (seg[strspn(seg, " \t\n")] != '\0')
+            commands[num_cmds++] = seg;
+        if (last)
+            break;
+        seg = ++p;
     }
     if (num_cmds < 2)
         return 0;
+    before_fork();
 
     int pipefds[2 * (num_cmds - 1)];
+    pid_t pids[num_cmds];
+    char names[num_cmds][24];
+    char** stages[num_cmds];
+
+    // expand every stage first, so a bad one runs none of them
+    for (int i = 0; i < num_cmds; i++) {
+        if (pipemon) {
+            const char* text = commands[i] + strspn(commands[i], " \t");
+            int len = strcspn(text, "\n");
+            while (len > 0 && isspace((unsigned char)text[len - 1]))
+                len--;
+            snprintf(names[i], sizeof(names[i]), "%.*s", len, text);
+        }
+        long long t0 = trace_now();
+        stages[i] = tokenize(commands[i]);
+        trace_event("tokenize", t0, trace_now());
+        if (stages[i] == NULL || stages[i][0] == NULL) {
+            if (stages[i] != NULL)
+                fprintf(stderr, "Invalid command segment\n");
+            for (int j = 0; j <= i; j++) {
+                if (stages[j] != NULL)
+                    free_arglist(stages[j]);
+            }
+            last_status = 1;
+            return 1;
+        }
+    }
+
+    // reap the stages ourselves, by pid, so the SIGCHLD handler can't take
+    // their status and wait() can't pick up an unrelated background job
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
     for (int i = 0; i < num_cmds - 1; i++) {
         if (pipe(pipefds + i * 2) == -1) {
             perror("Pipe failed");
@@ -191,17 +1200,15 @@ int handle_pipes(char *cmdline) {
     }
 
     for (int i = 0; i < num_cmds; i++) {
-        char** arglist = tokenize(commands[i]);
-        if (arglist == NULL || arglist[0] == NULL) {
-            fprintf(stderr, "Invalid command segment\n");
-            exit(1);
-        }
-
+        char** arglist = stages[i];
+        long long t0 = trace_now();
         pid_t pid = fork();
         if (pid == -1) {
             perror("Fork failed");
             exit(1);
         } else if (pid == 0) {
+            trace_event("child_start", t0, trace_now());
+            sigprocmask(SIG_SETMASK, &old, NULL);
             if (i > 0) {
                 dup2(pipefds[(i - 1) * 2], STDIN_FILENO);
             }
@@ -211,27 +1218,2502 @@ int handle_pipes(char *cmdline) {
             for (int j = 0; j < 2 * (num_cmds - 1); j++) {
                 close(pipefds[j]);
             }
-            execvp(arglist[0], arglist);
+            exec_traced(arglist);
             perror("Command execution failed");
             exit(1);
         } else {
-            for (int j = 0; arglist[j] != NULL; j++) {
-                free(arglist[j]);
-            }
-            free(arglist);
+            trace_event("fork", t0, trace_now());
+            pids[i] = pid;
+            free_arglist(arglist);
         }
     }
 
+    // the monitor keeps its own read ends; the stages must still see EOF
+    // and EPIPE, which only the write ends being closed here guarantees
+    int read_fds[num_cmds];
+    for (int i = 0; i < num_cmds - 1; i++)
+        read_fds[i] = pipemon ? fcntl(pipefds[i * 2], F_DUPFD_CLOEXEC, 0) : -1;
     for (int i = 0; i < 2 * (num_cmds - 1); i++) {
         close(pipefds[i]);
     }
-    for (int i = 0; i < num_cmds; i++) {
-        wait(NULL);
+    long long t0 = trace_now();
+    int status = 0;
+    if (pipemon) {
+        status = monitor_pipeline(pids, names, num_cmds, read_fds);
+    } else {
+        for (int i = 0; i < num_cmds; i++) {
+            if (waitpid(pids[i], &status, 0) == -1)
+                status = 1 << 8;
+        }
     }
+    trace_event("waitpid", t0, trace_now());
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    // like sh, the pipeline's status is that of its last command
+    last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
     return 1;
 }
 
 void sigchld_handler(int sig) {
-    // Reap all terminated child processes
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    // Reap all terminated child processes, noting which background jobs finished
+    long long t0 = trace_now();
+    int saved_errno = errno;
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i].id != 0 && jobs[i].pid == pid) {
+                jobs[i].status = status;
+                jobs[i].done = 1;
+            }
+        }
+    }
+    errno = saved_errno;
+    trace_event("sigchld_reap", t0, trace_now());
+}
+
+// ---------------------------------------------------------------------------
+// builtins
+// ---------------------------------------------------------------------------
+
+// writes s with echo -e's backslash escapes; returns 0 after \c (stop output)
+int echo_escaped(const char* s) {
+    for (; *s; s++) {
+        if (*s != '\\' || s[1] == '\0') {
+            putchar(*s);
+            continue;
+        }
+        int c = *++s, n = 0, digits = 0;
+        switch (c) {
+            case 'a': putchar('\a'); break;
+            case 'b': putchar('\b'); break;
+            case 'c': return 0;
+            case 'e': putchar('\033'); break;
+            case 'f': putchar('\f'); break;
+            case 'n': putchar('\n'); break;
+            case 'r': putchar('\r'); break;
+            case 't': putchar('\t'); break;
+            case 'v': putchar('\v'); break;
+            case '\\': putchar('\\'); break;
+            case '0':   // \0NNN, up to three octal digits
+                while (digits < 3 && s[1] >= '0' && s[1] <= '7') {
+                    n = n * 8 + (*++s - '0');
+                    digits++;
+                }
+                putchar(n);
+                break;
+            case 'x':   // \xHH, one or two hex digits
+                while (digits < 2 && isxdigit((unsigned char)s[1])) {
+                    c = *++s;
+                    n = n * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+                    digits++;
+                }
+                if (digits == 0)
+                    fputs("\\x", stdout);
+                else
+                    putchar(n);
+                break;
+            default:
+                putchar('\\');
+                putchar(c);
+        }
+    }
+    return 1;
+}
+
+// echo [-neE]... as in coreutils: a word counts as options only if it is
+// made up entirely of n, e and E; anything else is printed
+void builtin_echo(char** arglist) {
+    int newline = 1, escapes = 0, i = 1;
+    for (; arglist[i] != NULL && arglist[i][0] == '-' && arglist[i][1] != '\0' &&
+           strspn(arglist[i] + 1, "neE") == strlen(arglist[i] + 1); i++) {
+        for (const char* o = arglist[i] + 1; *o; o++) {
+            if (*o == 'n')
+                newline = 0;
+            else
+                escapes = (*o == 'e');
+        }
+    }
+    for (; arglist[i] != NULL; i++) {
+        if (escapes ? !echo_escaped(arglist[i]) : fputs(arglist[i], stdout) < 0)
+            return;
+        if (arglist[i + 1] != NULL)
+            putchar(' ');
+    }
+    if (newline)
+        putchar('\n');
+}
+
+// returns 1 if arglist was a builtin and has been run
+int execute_builtin(char** arglist) {
+    if (strcmp(arglist[0], "set") == 0) {
+        if (arglist[1] == NULL || arglist[2] == NULL) {
+            for (ShellOption* o = shell_options; o->name != NULL; o++)
+                printf("%-12s%s\n", o->name, *o->flag ? "on" : "off");
+            return 1;
+        }
+        ShellOption* o = shell_options;
+        while (o->name != NULL && strcmp(o->name, arglist[2]) != 0)
+            o++;
+        if (o->name == NULL || (strcmp(arglist[1], "-o") != 0 && strcmp(arglist[1], "+o") != 0)) {
+            fprintf(stderr, "set: usage: set [-o|+o] option\n");
+            return 1;
+        }
+        *o->flag = (arglist[1][0] == '-');
+        trace_init();
+        return 1;
+    }
+    if (strcmp(arglist[0], "jobs") == 0) {
+        // jobs -o %N prints everything job N has written so far
+        if (arglist[1] != NULL && strcmp(arglist[1], "-o") == 0) {
+            int r = arglist[2] != NULL && arglist[2][0] == '%' ? print_job_output(atoi(arglist[2] + 1), 0) : -3;
+            if (r == -1)
+                fprintf(stderr, "jobs: %s: no such job\n", arglist[2]);
+            else if (r == -2)
+                fprintf(stderr, "jobs: %s: output not captured\n", arglist[2]);
+            else if (r == -3)
+                fprintf(stderr, "jobs: usage: jobs [-o %%N]\n");
+        } else {
+            list_jobs();
+        }
+        return 1;
+    }
+    if (strcmp(arglist[0], "read") == 0) {
+        builtin_read(arglist);
+        return 1;
+    }
+    if (strcmp(arglist[0], "echo") == 0) {
+        // in-process so loop bodies don't fork for every line
+        builtin_echo(arglist);
+        return 1;
+    }
+    if (strcmp(arglist[0], "zygote") == 0) {
+        if (arglist[1] == NULL || strcmp(arglist[1], "bench") != 0) {
+            printf("zygote: %s\n", zygote_fd != -1 ? "running" : "off (start the shell with SHELL_ZYGOTE=N)");
+        } else if (zygote_fd == -1) {
+            fprintf(stderr, "zygote: not running\n");
+        } else {
+            int runs = arglist[2] ? atoi(arglist[2]) : 1000;
+            zygote_bench(runs > 0 ? runs : 1000, arglist[2] && arglist[3] ? atoi(arglist[3]) : 0);
+        }
+        return 1;
+    }
+    if (strcmp(arglist[0], "on") == 0) {
+        run_on(arglist);
+        return 1;
+    }
+    if (strcmp(arglist[0], "tail") == 0) {
+        // tail [-n N] %N shows the end of a job's output; any other tail is the real one
+        int lines = 10, i = 1;
+        if (arglist[1] != NULL && strcmp(arglist[1], "-n") == 0 && arglist[2] != NULL) {
+            lines = atoi(arglist[2]);
+            i = 3;
+        }
+        if (arglist[i] == NULL || arglist[i][0] != '%' || arglist[i + 1] != NULL)
+            return 0;
+        int r = print_job_output(atoi(arglist[i] + 1), lines > 0 ? lines : 1);
+        if (r == -1)
+            fprintf(stderr, "tail: %s: no such job\n", arglist[i]);
+        else if (r == -2)
+            fprintf(stderr, "tail: %s: output not captured\n", arglist[i]);
+        return 1;
+    }
+    if (strcmp(arglist[0], "trace") == 0) {
+        if (arglist[1] != NULL && strcmp(arglist[1], "dump") == 0) {
+            if (trace_dump(arglist[2]) == -1)
+                perror("trace dump");
+        } else if (arglist[1] != NULL && strcmp(arglist[1], "clear") == 0) {
+            if (trace_ring != NULL)
+                __atomic_store_n(&trace_ring->head, 0, __ATOMIC_RELEASE);
+        } else {
+            fprintf(stderr, "trace: usage: trace dump [file] | trace clear\n");
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// phase tracing (set -o trace-perf)
+//
+// Events go into a ring buffer in a MAP_SHARED mapping so forked children can
+// record their own phases (scheduling delay, PATH lookup) into the same
+// buffer. Writers claim a slot with an atomic fetch-and-add and publish it by
+// storing the slot's sequence number last, so the parent, its children and
+// the SIGCHLD handler never need a lock. "trace dump" writes the buffer as
+// Chrome trace JSON, which loads directly into Perfetto or chrome://tracing.
+// ---------------------------------------------------------------------------
+
+int main_pid = 0;
+
+long long trace_now(void) {
+    struct timespec ts;
+    if (!trace_enabled)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void trace_init(void) {
+    if (trace_ring == NULL) {
+        const char* env = getenv("SHELL_TRACE_PERF");
+        if (env != NULL && *env && strcmp(env, "0") != 0)
+            trace_enabled = 1;
+        main_pid = getpid();
+    }
+    if (trace_enabled)
+        trace_map();
+}
+
+// maps the shared ring if that hasn't happened yet; children forked before
+// this point can't record into it
+void trace_map(void) {
+    if (trace_ring != NULL)
+        return;
+    trace_ring = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (trace_ring == MAP_FAILED) {
+        perror("trace: mmap failed");
+        trace_ring = NULL;
+        trace_enabled = 0;
+    }
+}
+
+// safe to call from children and from signal handlers
+void trace_event(const char* name, long long start_ns, long long end_ns) {
+    if (!trace_enabled || trace_ring == NULL)
+        return;
+    unsigned long seq = __atomic_fetch_add(&trace_ring->head, 1, __ATOMIC_RELAXED);
+    TraceEvent* e = &trace_ring->events[seq & (TRACE_RING_SIZE - 1)];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->name = name;
+    e->start_ns = start_ns;
+    e->end_ns = end_ns;
+    e->pid = getpid();
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// execvp() with the PATH search done (and timed) here, so it shows up as
+// its own phase; the resolved path still goes through execvp() so scripts
+// without a #! line keep working
+void exec_traced(char** arglist) {
+    if (!trace_enabled || strchr(arglist[0], '/') != NULL) {
+        trace_event("exec", trace_now(), trace_now());
+        execvp(arglist[0], arglist);
+        return;
+    }
+
+    long long t0 = trace_now();
+    const char* path = getenv("PATH");
+    char full[4096];
+    char* found = NULL;
+    for (const char* dir = path ? path : "/bin:/usr/bin"; dir != NULL && found == NULL;) {
+        const char* colon = strchr(dir, ':');
+        int len = colon ? colon - dir : (int)strlen(dir);
+        snprintf(full, sizeof(full), "%.*s/%s", len ? len : 1, len ? dir : ".", arglist[0]);
+        if (access(full, X_OK) == 0)
+            found = full;
+        dir = colon ? colon + 1 : NULL;
+    }
+    trace_event("path_lookup", t0, trace_now());
+
+    trace_event("exec", trace_now(), trace_now());
+    execvp(found ? found : arglist[0], arglist);
+}
+
+// writes the buffered events as Chrome trace JSON to path (stdout if NULL)
+int trace_dump(const char* path) {
+    FILE* fp = path ? fopen(path, "w") : stdout;
+    if (fp == NULL)
+        return -1;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"args\":{\"name\":\"shell\"}}", main_pid);
+    if (trace_ring != NULL) {
+        unsigned long head = __atomic_load_n(&trace_ring->head, __ATOMIC_ACQUIRE);
+        unsigned long first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (unsigned long seq = first; seq < head; seq++) {
+            TraceEvent* e = &trace_ring->events[seq & (TRACE_RING_SIZE - 1)];
+            if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != seq + 1)
+                continue;  // overwritten or still being written
+            long long dur = e->end_ns - e->start_ns;
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,",
+                    e->name, dur > 0 ? "X" : "i", e->start_ns / 1000.0);
+            if (dur > 0)
+                fprintf(fp, "\"dur\":%.3f,", dur / 1000.0);
+            else
+                fprintf(fp, "\"s\":\"t\",");
+            fprintf(fp, "\"pid\":%d,\"tid\":%d}", main_pid, e->pid);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    if (path)
+        fclose(fp);
+    else
+        fflush(fp);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// background job output capture
+//
+// A single thread poll()s the output pipes of all running jobs and appends
+// what it reads to each job's ring buffer. Once the ring is full the oldest
+// bytes are either dropped or, with set -o job-spill, gzip-compressed into
+// a mkstemps() file $TMPDIR/newshell-job-XXXXXX.gz, so memory stays bounded
+// however noisy a job is.
+// ---------------------------------------------------------------------------
+
+// appends n bytes to the job's ring; caller holds jobs_lock
+void job_append(Job* job, const char* data, size_t n) {
+    job->total += n;
+
+    // whatever no longer fits is pushed out of the ring, oldest first
+    if (job->len + n > JOB_BUFFER_SIZE) {
+        size_t evict = job->len + n - JOB_BUFFER_SIZE;
+        size_t from_ring = evict < job->len ? evict : job->len;
+
+        if (job->spill_enabled && job->spill == NULL && job->spill_path[0] == '\0') {
+            // a fresh 0600 file (mkstemps uses O_EXCL), so nobody can plant
+            // a symlink for us to truncate
+            const char* tmp = getenv("TMPDIR");
+            snprintf(job->spill_path, sizeof(job->spill_path), "%.40s/newshell-job-XXXXXX.gz",
+                     tmp ? tmp : "/tmp");
+            int fd = mkstemps(job->spill_path, 3);
+            if (fd != -1 && (job->spill = gzdopen(fd, "wb1")) == NULL) {
+                close(fd);
+                unlink(job->spill_path);
+            }
+            if (job->spill == NULL) {
+                job->spill_path[0] = '\0';
+                job->spill_enabled = 0;  // don't retry on every eviction
+            }
+        }
+        if (job->spill != NULL) {
+            size_t first = JOB_BUFFER_SIZE - job->start;
+            if (first > from_ring)
+                first = from_ring;
+            gzwrite(job->spill, job->buf + job->start, first);
+            gzwrite(job->spill, job->buf, from_ring - first);
+            if (evict > from_ring)
+                gzwrite(job->spill, data, evict - from_ring);
+        }
+        job->start = (job->start + from_ring) % JOB_BUFFER_SIZE;
+        job->len -= from_ring;
+        if (evict > from_ring) {
+            data += evict - from_ring;
+            n -= evict - from_ring;
+        }
+    }
+
+    size_t end = (job->start + job->len) % JOB_BUFFER_SIZE;
+    size_t first = JOB_BUFFER_SIZE - end;
+    if (first > n)
+        first = n;
+    memcpy(job->buf + end, data, first);
+    memcpy(job->buf, data + first, n - first);
+    job->len += n;
+}
+
+void* capture_thread(void* arg) {
+    (void)arg;
+    static char buf[JOB_BUFFER_SIZE];
+    struct pollfd fds[MAX_JOBS + 1];
+    int ids[MAX_JOBS + 1];
+
+    while (1) {
+        int n = 0;
+        pthread_mutex_lock(&jobs_lock);
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i].id != 0 && jobs[i].out_fd != -1) {
+                fds[n].fd = jobs[i].out_fd;
+                fds[n].events = POLLIN;
+                ids[n++] = jobs[i].id;
+            }
+        }
+        pthread_mutex_unlock(&jobs_lock);
+        fds[n].fd = capture_wake[0];
+        fds[n].events = POLLIN;
+
+        if (poll(fds, n + 1, -1) == -1)
+            continue;
+        if (fds[n].revents & POLLIN)
+            read(capture_wake[0], buf, sizeof(buf));  // new job registered
+
+        for (int k = 0; k < n; k++) {
+            if (fds[k].revents == 0)
+                continue;
+            ssize_t r = read(fds[k].fd, buf, sizeof(buf));
+            pthread_mutex_lock(&jobs_lock);
+            Job* job = find_job(ids[k]);
+            if (job != NULL) {
+                if (r > 0) {
+                    job_append(job, buf, r);
+                } else {
+                    close(job->out_fd);
+                    job->out_fd = -1;
+                    if (job->spill != NULL) {
+                        gzclose(job->spill);
+                        job->spill = NULL;
+                    }
+                }
+            }
+            pthread_mutex_unlock(&jobs_lock);
+        }
+    }
+    return NULL;
+}
+
+// the job with this id, or NULL; caller holds jobs_lock
+Job* find_job(int id) {
+    for (int i = 0; id > 0 && i < MAX_JOBS; i++) {
+        if (jobs[i].id == id)
+            return &jobs[i];
+    }
+    return NULL;
+}
+
+void job_free(Job* job) {
+    if (job->out_fd != -1)
+        close(job->out_fd);
+    if (job->spill != NULL)
+        gzclose(job->spill);
+    if (job->spill_path[0])
+        unlink(job->spill_path);
+    free(job->buf);
+    memset(job, 0, sizeof(Job));
+    job->out_fd = -1;
+}
+
+// removes spill files on exit; the jobs themselves keep running
+void jobs_cleanup(void) {
+    pthread_mutex_lock(&jobs_lock);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].spill_path[0])
+            unlink(jobs[i].spill_path);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+// claims a slot for a job about to be started: a free one, else the one of
+// the oldest finished job whose output has been drained. NULL if all slots
+// hold live jobs
+Job* job_reserve(void) {
+    pthread_mutex_lock(&jobs_lock);
+    Job* slot = NULL;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        Job* job = &jobs[i];
+        if (job->id == 0) {
+            slot = job;
+            break;
+        }
+        if (job->id > 0 && job->done && job->out_fd == -1 && (slot == NULL || job->id < slot->id))
+            slot = job;
+    }
+    if (slot != NULL) {
+        if (slot->id != 0)
+            job_free(slot);
+        slot->id = -1;
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    return slot;
+}
+
+// fills in a slot from job_reserve() (NULL: the job isn't tracked);
+// out_fd is -1 if its output isn't captured
+Job* job_start(Job* job, pid_t pid, char** arglist, int out_fd) {
+    if (job == NULL)
+        return NULL;
+    if (out_fd != -1 && capture_wake[0] == -1) {
+        sigset_t block, old;
+        if (pipe2(capture_wake, O_CLOEXEC | O_NONBLOCK) == -1) {
+            perror("pipe failed");
+            close(out_fd);
+            out_fd = -1;
+        } else {
+            // SIGCHLD must keep going to the main thread
+            sigemptyset(&block);
+            sigaddset(&block, SIGCHLD);
+            pthread_sigmask(SIG_BLOCK, &block, &old);
+            pthread_create(&capture_tid, NULL, capture_thread, NULL);
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+        }
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    job->id = next_job_id++;
+    job->pid = pid;
+    job->out_fd = out_fd;
+    job->spill_enabled = job_spill;
+    job->buf = out_fd != -1 ? malloc(JOB_BUFFER_SIZE) : NULL;
+    job->command[0] = '\0';
+    for (int i = 0; arglist[i] != NULL; i++) {
+        strncat(job->command, arglist[i], sizeof(job->command) - strlen(job->command) - 2);
+        if (arglist[i + 1] != NULL)
+            strcat(job->command, " ");
+    }
+    pthread_mutex_unlock(&jobs_lock);
+
+    if (out_fd != -1)
+        write(capture_wake[1], "", 1);
+    return job;
+}
+
+void report_finished_jobs(void) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id > 0 && jobs[i].done && !jobs[i].reported) {
+            jobs[i].reported = 1;
+            int st = jobs[i].status;
+            printf("[%d] Done (%d) %s\n", jobs[i].id,
+                   WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st), jobs[i].command);
+        }
+    }
+}
+
+int job_cmp(const void* a, const void* b) {
+    return (*(Job* const*)a)->id - (*(Job* const*)b)->id;
+}
+
+void list_jobs(void) {
+    // slots are reused in any order, so sort by job number
+    Job* order[MAX_JOBS];
+    int n = 0;
+    pthread_mutex_lock(&jobs_lock);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id > 0)
+            order[n++] = &jobs[i];
+    }
+    qsort(order, n, sizeof(Job*), job_cmp);
+    for (int i = 0; i < n; i++) {
+        Job* job = order[i];
+        printf("[%d] %d %-8s %s", job->id, job->pid, job->done ? "Done" : "Running", job->command);
+        if (job->buf != NULL)
+            printf("  (%llu bytes output%s)", job->total, job->spill_path[0] ? ", spilled" : "");
+        printf("\n");
+    }
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+// prints the captured output of job id (only the last last_lines lines if
+// non-zero); returns -1 if there is no such job, -2 if its output wasn't
+// captured (it went to a file or the shell's stdout wasn't a terminal)
+int print_job_output(int id, int last_lines) {
+    if (id <= 0)
+        return -1;
+    pthread_mutex_lock(&jobs_lock);
+    Job* job = find_job(id);
+    if (job == NULL || job->buf == NULL) {
+        int r = job == NULL ? -1 : -2;
+        pthread_mutex_unlock(&jobs_lock);
+        return r;
+    }
+
+    // copy the ring out so the capture thread isn't held up by the terminal
+    size_t len = job->len;
+    char* out = malloc(len + 1);
+    size_t first = JOB_BUFFER_SIZE - job->start;
+    if (first > len)
+        first = len;
+    memcpy(out, job->buf + job->start, first);
+    memcpy(out + first, job->buf, len - first);
+    if (job->spill != NULL)
+        gzflush(job->spill, Z_SYNC_FLUSH);
+    char spill_path[sizeof(job->spill_path)];
+    strcpy(spill_path, job->spill_path);
+    pthread_mutex_unlock(&jobs_lock);
+
+    size_t from = 0;
+    if (last_lines > 0) {
+        from = len;
+        if (from > 0 && out[from - 1] == '\n')
+            from--;
+        while (from > 0 && last_lines > 0) {
+            from--;
+            if (out[from] == '\n' && --last_lines == 0)
+                from++;
+        }
+    } else if (spill_path[0]) {
+        gzFile gz = gzopen(spill_path, "rb");
+        char chunk[8192];
+        int r;
+        while (gz != NULL && (r = gzread(gz, chunk, sizeof(chunk))) > 0)
+            fwrite(chunk, 1, r, stdout);
+        if (gz != NULL)
+            gzclose(gz);
+    }
+    fwrite(out + from, 1, len - from, stdout);
+    fflush(stdout);
+    free(out);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// on [-j N] host1,host2,... command...
+//
+// Runs "$SHELL_ON_TRANSPORT host command..." (default transport: ssh) for
+// every host, at most N at a time, through spawn(). Output lines are printed
+// as they arrive, prefixed with the host name, and a summary of the exit
+// codes is printed at the end. $? is 0 if every host succeeded, else the
+// exit code of the first host (in list order) that didn't. Any local
+// command that takes the host as its first argument can stand in for ssh.
+// ---------------------------------------------------------------------------
+
+#define ON_DEFAULT_JOBS 16
+
+typedef struct {
+    char* host;
+    pid_t pid;
+    int fd;            // -1 when not running
+    char line[1024];   // partial output line
+    int line_len;
+    int status;
+} OnHost;
+
+void on_flush_line(OnHost* h) {
+    printf("%s: %.*s\n", h->host, h->line_len, h->line);
+    h->line_len = 0;
+}
+
+void run_on(char** arglist) {
+    int max_jobs = ON_DEFAULT_JOBS;
+    int a = 1;
+    if (arglist[a] != NULL && strcmp(arglist[a], "-j") == 0 && arglist[a + 1] != NULL) {
+        max_jobs = atoi(arglist[a + 1]);
+        a += 2;
+    }
+    if (arglist[a] == NULL || arglist[a + 1] == NULL || max_jobs < 1) {
+        fprintf(stderr, "on: usage: on [-j N] host1,host2,... command...\n");
+        last_status = 2;
+        return;
+    }
+
+    // transport words, then a slot for the host, then the command
+    const char* env = getenv("SHELL_ON_TRANSPORT");
+    char* transport = strdup(env && *env ? env : "ssh");
+    StrVec argv = { NULL, 0, 0 };
+    for (char* w = strtok(transport, " \t"); w != NULL; w = strtok(NULL, " \t"))
+        strvec_push(&argv, w);
+    int host_slot = argv.count;
+    strvec_push(&argv, NULL);
+    for (int i = a + 1; arglist[i] != NULL; i++)
+        strvec_push(&argv, arglist[i]);
+    strvec_push(&argv, NULL);
+
+    char* hostlist = strdup(arglist[a]);
+    int nhosts = 1;
+    for (char* c = hostlist; *c; c++)
+        nhosts += (*c == ',');
+    OnHost* hosts = calloc(nhosts, sizeof(OnHost));
+    nhosts = 0;
+    for (char* h = strtok(hostlist, ","); h != NULL; h = strtok(NULL, ",")) {
+        hosts[nhosts].host = h;
+        hosts[nhosts].fd = -1;
+        nhosts++;
+    }
+
+    // reap our own children; the SIGCHLD handler would otherwise take their status
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    // like ssh -n: concurrent transports must not fight over the terminal
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int next = 0, running = 0, failed = 0;
+    struct pollfd* fds = calloc(nhosts + 1, sizeof(struct pollfd));
+    int* which = calloc(nhosts + 1, sizeof(int));
+    char buf[4096];
+
+    while (next < nhosts || running > 0) {
+        while (next < nhosts && running < max_jobs) {
+            OnHost* h = &hosts[next++];
+            int p[2];
+            if (pipe2(p, O_CLOEXEC) == -1) {
+                perror("on: pipe failed");
+                h->status = 1 << 8;
+                continue;
+            }
+            argv.items[host_slot] = h->host;
+            h->pid = spawn(argv.items, devnull, p[1], p[1]);
+            close(p[1]);
+            if (h->pid == -1) {
+                perror("on: fork failed");
+                close(p[0]);
+                h->status = 1 << 8;
+                continue;
+            }
+            h->fd = p[0];
+            running++;
+        }
+
+        int n = 0;
+        for (int i = 0; i < next; i++) {
+            if (hosts[i].fd != -1) {
+                fds[n].fd = hosts[i].fd;
+                fds[n].events = POLLIN;
+                which[n++] = i;
+            }
+        }
+        if (n == 0)
+            continue;
+        if (poll(fds, n, -1) == -1)
+            continue;
+
+        for (int k = 0; k < n; k++) {
+            if (fds[k].revents == 0)
+                continue;
+            OnHost* h = &hosts[which[k]];
+            ssize_t r = read(h->fd, buf, sizeof(buf));
+            for (ssize_t i = 0; i < r; i++) {
+                if (buf[i] == '\n' || h->line_len == (int)sizeof(h->line))
+                    on_flush_line(h);
+                if (buf[i] != '\n')
+                    h->line[h->line_len++] = buf[i];
+            }
+            if (r <= 0) {
+                if (h->line_len > 0)
+                    on_flush_line(h);
+                close(h->fd);
+                h->fd = -1;
+                waitpid(h->pid, &h->status, 0);
+                running--;
+            }
+        }
+        fflush(stdout);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (devnull != -1)
+        close(devnull);
+
+    last_status = 0;
+    for (int i = 0; i < nhosts; i++) {
+        int st = hosts[i].status;
+        if (WIFEXITED(st) && WEXITSTATUS(st) == 0)
+            continue;
+        if (failed++ == 0)
+            last_status = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+    }
+    printf("on: %d host%s, %d ok, %d failed", nhosts, nhosts == 1 ? "" : "s", nhosts - failed, failed);
+    for (int i = 0, shown = 0; i < nhosts; i++) {
+        int st = hosts[i].status;
+        if (WIFEXITED(st) && WEXITSTATUS(st) == 0)
+            continue;
+        printf("%s %s=%d", shown++ ? "," : ":", hosts[i].host,
+               WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st));
+    }
+    printf("\n");
+
+    free(fds);
+    free(which);
+    free(hosts);
+    free(hostlist);
+    free(argv.items);
+    free(transport);
+}
+
+// ---------------------------------------------------------------------------
+// watch [-n secs] [-f path]... command [| command]...
+//
+// Reruns the pipeline every secs seconds (default 2) or, with -f, only when
+// inotify reports a change under one of the paths (with both, whichever comes
+// first). Between runs the shell sleeps in poll(), so an idle watch costs no
+// CPU and no forks. Only the lines that differ from the previous run are
+// redrawn. Ctrl-C returns to the prompt.
+// A watch follows an inode, so when a path is deleted or renamed over (as
+// editors save) its watch is re-added by path. A path that can't be watched
+// (yet) is retried every interval, and the interval is used meanwhile.
+// ---------------------------------------------------------------------------
+
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                      IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+volatile sig_atomic_t watch_interrupted = 0;
+
+void watch_sigint(int sig) {
+    (void)sig;
+    watch_interrupted = 1;
+}
+
+// adds a watch for every path that has none; returns how many are missing
+int watch_arm(int ifd, StrVec* paths, int* wds, int report) {
+    int missing = 0;
+    for (int i = 0; i < paths->count; i++) {
+        if (wds[i] == -1)
+            wds[i] = inotify_add_watch(ifd, paths->items[i], WATCH_EVENTS);
+        if (wds[i] == -1) {
+            if (report)
+                fprintf(stderr, "watch: %s: %s\n", paths->items[i], strerror(errno));
+            missing++;
+        }
+    }
+    return missing;
+}
+
+// forgets the watches whose inode went away or moved, so watch_arm() puts
+// them back on whatever the path names now
+void watch_drop_gone(int ifd, const char* buf, ssize_t n, StrVec* paths, int* wds) {
+    for (const char* p = buf; p < buf + n;) {
+        const struct inotify_event* ev = (const struct inotify_event*)p;
+        if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            for (int i = 0; i < paths->count; i++) {
+                if (wds[i] == ev->wd)
+                    wds[i] = -1;
+            }
+            if (ev->mask & IN_MOVE_SELF)
+                inotify_rm_watch(ifd, ev->wd);  // still on the renamed file otherwise
+        }
+        p += sizeof(struct inotify_event) + ev->len;
+    }
+}
+
+// runs cmdline in a child with stdout/stderr captured; returns the output
+// (NUL-terminated, caller frees) and stores its length in *len
+char* watch_run(const char* cmdline, size_t* len) {
+    int p[2];
+    before_fork();
+    if (pipe2(p, O_CLOEXEC) == -1) {
+        perror("watch: pipe failed");
+        return NULL;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("watch: fork failed");
+        close(p[0]);
+        close(p[1]);
+        return NULL;
+    }
+    if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        dup2(p[1], STDOUT_FILENO);
+        dup2(p[1], STDERR_FILENO);
+        char* line = strdup(cmdline);
+        if (handle_pipes(line) == 1)
+            exit(0);
+        char** arglist = tokenize(strcpy(line, cmdline));
+        if (arglist == NULL)
+            exit(1);
+        if (arglist[0] == NULL)
+            exit(0);
+        if (execute_builtin(arglist)) {
+            fflush(stdout);
+            exit(0);
+        }
+        exec_traced(arglist);
+        perror("Command not found...");
+        exit(1);
+    }
+    close(p[1]);
+
+    size_t cap = 4096, n = 0;
+    char* out = malloc(cap);
+    ssize_t r;
+    while ((r = read(p[0], out + n, cap - n - 1)) != 0) {
+        if (r == -1) {
+            if (errno == EINTR && !watch_interrupted)
+                continue;
+            break;
+        }
+        n += r;
+        if (cap - n - 1 == 0)
+            out = realloc(out, cap *= 2);
+    }
+    close(p[0]);
+    waitpid(pid, NULL, 0);
+    out[n] = '\0';
+    *len = n;
+    return out;
+}
+
+// splits buf into lines in place; returns the number of lines
+int watch_split(char* buf, size_t len, StrVec* lines) {
+    lines->count = 0;
+    char* p = buf;
+    char* end = buf + len;
+    while (p < end) {
+        char* nl = memchr(p, '\n', end - p);
+        if (nl != NULL)
+            *nl = '\0';
+        strvec_push(lines, p);
+        p = nl ? nl + 1 : end;
+    }
+    return lines->count;
+}
+
+void run_watch(char* line) {
+    double interval = 2;
+    int interval_given = 0;
+    StrVec paths = { NULL, 0, 0 };
+
+    // options come first; the rest of the line is the pipeline
+    char* p = line;
+    while (1) {
+        while (isspace((unsigned char)*p))
+            p++;
+        if (p[0] != '-' || (p[1] != 'n' && p[1] != 'f') || !isspace((unsigned char)p[2]))
+            break;
+        char opt = p[1];
+        p += 2;
+        while (isspace((unsigned char)*p))
+            p++;
+        char* word = p;
+        while (*p && !isspace((unsigned char)*p))
+            p++;
+        if (*p)
+            *p++ = '\0';
+        if (opt == 'n') {
+            interval = atof(word);
+            interval_given = 1;
+        } else {
+            strvec_push(&paths, word);
+        }
+    }
+    if (*p == '\0' || interval <= 0) {
+        fprintf(stderr, "watch: usage: watch [-n secs] [-f path]... command\n");
+        free(paths.items);
+        return;
+    }
+    const char* cmdline = p;
+
+    int ifd = -1, missing = 0;
+    int wds[paths.count + 1];
+    if (paths.count > 0) {
+        ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (ifd == -1)
+            perror("watch: inotify");
+        for (int i = 0; i < paths.count; i++)
+            wds[i] = -1;
+        if (ifd != -1)
+            missing = watch_arm(ifd, &paths, wds, 1);
+    }
+
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_sigint;  // no SA_RESTART, so poll() and read() return
+    sigaction(SIGINT, &sa, &old_sa);
+    watch_interrupted = 0;
+
+    int tty = isatty(STDOUT_FILENO);
+    struct winsize ws = { 24, 80, 0, 0 };
+    if (tty && (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 || ws.ws_row == 0)) {
+        ws.ws_row = 24;
+        ws.ws_col = 80;
+    }
+    int rows = ws.ws_row > 2 ? ws.ws_row - 2 : 1;
+
+    char* prev = NULL;
+    StrVec prev_lines = { NULL, 0, 0 }, cur_lines = { NULL, 0, 0 };
+    int first = 1;
+
+    while (!watch_interrupted) {
+        size_t len;
+        char* out = watch_run(cmdline, &len);
+        if (out == NULL || watch_interrupted) {
+            free(out);
+            break;
+        }
+        watch_split(out, len, &cur_lines);
+
+        if (!tty) {
+            // no cursor control: print the whole output whenever it changes
+            int same = !first && cur_lines.count == prev_lines.count;
+            for (int i = 0; same && i < cur_lines.count; i++)
+                same = strcmp(cur_lines.items[i], prev_lines.items[i]) == 0;
+            if (!same) {
+                for (int i = 0; i < cur_lines.count; i++)
+                    printf("%s\n", cur_lines.items[i]);
+            }
+        } else {
+            time_t now = time(NULL);
+            char stamp[32];
+            strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+            if (first)
+                printf("\033[H\033[2J");
+            printf("\033[1;1HEvery %gs: %.*s\033[K\033[1;%dH%s\n", interval,
+                   ws.ws_col > 30 ? ws.ws_col - 30 : 10, cmdline,
+                   ws.ws_col > 8 ? ws.ws_col - 8 : 1, stamp);
+            for (int i = 0; i < cur_lines.count && i < rows; i++) {
+                if (!first && i < prev_lines.count && strcmp(cur_lines.items[i], prev_lines.items[i]) == 0)
+                    continue;
+                printf("\033[%d;1H%.*s\033[K", i + 3, ws.ws_col, cur_lines.items[i]);
+            }
+            int shown = cur_lines.count < rows ? cur_lines.count : rows;
+            if (!first && prev_lines.count > shown)
+                printf("\033[%d;1H\033[J", shown + 3);
+        }
+        fflush(stdout);
+
+        free(prev);
+        prev = out;
+        StrVec t = prev_lines;
+        prev_lines = cur_lines;
+        cur_lines = t;
+        first = 0;
+
+        // sleep until the interval is up or a watched path changes; with a
+        // path unwatched, the interval applies even without -n
+        int timeout = (ifd == -1 || interval_given || missing) ? (int)(interval * 1000) : -1;
+        struct pollfd pfd = { ifd, POLLIN, 0 };
+        int r = poll(&pfd, ifd != -1 ? 1 : 0, timeout);
+        if (r > 0) {
+            // let a burst of events (an editor saving, a build) settle, then drain them
+            char evbuf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t n;
+            poll(NULL, 0, 50);
+            while ((n = read(ifd, evbuf, sizeof(evbuf))) > 0)
+                watch_drop_gone(ifd, evbuf, n, &paths, wds);
+        }
+        if (ifd != -1)
+            missing = watch_arm(ifd, &paths, wds, 0);
+    }
+
+    if (tty)
+        printf("\033[%d;1H\n", (prev_lines.count < rows ? prev_lines.count : rows) + 3);
+    sigaction(SIGINT, &old_sa, NULL);
+    if (ifd != -1)
+        close(ifd);
+    free(prev);
+    free(prev_lines.items);
+    free(cur_lines.items);
+    free(paths.items);
+}
+
+// ---------------------------------------------------------------------------
+// server mode (v4 --server [socket])
+//
+// Keeps one initialised shell listening on a Unix socket: $SHELL_SOCKET, else
+// $XDG_RUNTIME_DIR/newshell.sock, else /tmp/newshell-<uid>/sock in a 0700
+// directory the server creates (and refuses to use if anyone else owns it or
+// can get into it). Both ends check the other's uid with SO_PEERCRED, since
+// whoever answers gets the client's environment and terminal. v4_client sends its argv,
+// environment and cwd, and passes its stdin/stdout/stderr with SCM_RIGHTS.
+// Each request runs in a fork of the warm server (a lone argument as a command
+// line, several as that exact argv), and the exit status goes back over the
+// socket, so a client pays for a connect and a fork instead of exec, dynamic
+// linking and shell startup.
+// ---------------------------------------------------------------------------
+
+// fixed header in front of every request; payload follows:
+// cwd, then argc argument strings, then envc environment strings, all NUL-terminated
+// (v4_client.c has the same definition)
+#define SERVER_MAGIC 0x76345348u   // "v4SH"
+
+typedef struct {
+    unsigned int magic;
+    unsigned int len;   // payload bytes
+    unsigned int argc;
+    unsigned int envc;
+} ServerRequest;
+
+// reads exactly n bytes; fds, if given, receives up to 3 passed descriptors
+int server_recv(int conn, void* data, size_t n, int* fds, int* nfds) {
+    size_t got = 0;
+    while (got < n) {
+        struct iovec iov = { (char*)data + got, n - got };
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(3 * sizeof(int))];
+        } ctl;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (fds != NULL) {
+            msg.msg_control = ctl.buf;
+            msg.msg_controllen = sizeof(ctl.buf);
+        }
+        ssize_t r = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+        if (r <= 0) {
+            if (r == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        struct cmsghdr* c = fds != NULL ? CMSG_FIRSTHDR(&msg) : NULL;
+        if (c != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            *nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(c), *nfds * sizeof(int));
+            fds = NULL;
+        }
+        got += r;
+    }
+    return 0;
+}
+
+// child side of one connection: take on the client's context, run, reply
+void server_handle(int conn) {
+    ServerRequest req;
+    int fds[3], nfds = 0;
+
+    if (server_recv(conn, &req, sizeof(req), fds, &nfds) == -1 || req.magic != SERVER_MAGIC)
+        exit(1);
+    char* payload = malloc(req.len + 1);
+    if (server_recv(conn, payload, req.len, NULL, NULL) == -1)
+        exit(1);
+    payload[req.len] = '\0';
+
+    for (int i = 0; i < nfds && i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+
+    char* p = payload;
+    char* end = payload + req.len;
+    if (chdir(p) == -1)
+        perror(p);
+    p += strlen(p) + 1;
+
+    char** argv = calloc(req.argc + 1, sizeof(char*));
+    unsigned int argc = 0;
+    while (argc < req.argc && p < end) {
+        argv[argc++] = p;
+        p += strlen(p) + 1;
+    }
+    clearenv();
+    for (unsigned int i = 0; i < req.envc && p < end; i++) {
+        putenv(p);
+        p += strlen(p) + 1;
+    }
+
+    // a single argument is a command line, as if typed at the prompt
+    // (v4_client 'ls | wc -l'); several are run as exactly that argv, so
+    // v4_client sh -c 'exit 5' keeps its argument boundaries
+    int status;
+    last_status = 0;
+    if (argc == 1)
+        status = run_command_line(argv[0]);
+    else if (argc == 0 || execute_builtin(argv))
+        status = last_status;
+    else
+        status = execute(argv, 0);
+    fflush(stdout);
+    fflush(stderr);
+    write(conn, &status, sizeof(status));
+    exit(status);
+}
+
+// the default socket path (v4_client.c has the same logic); the /tmp
+// fallback directory is created if needed. Returns -1 if it isn't safe
+int server_default_path(char* buf, size_t size) {
+    const char* run = getenv("XDG_RUNTIME_DIR");
+    if (run != NULL && *run) {
+        snprintf(buf, size, "%s/newshell.sock", run);
+        return 0;
+    }
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/tmp/newshell-%d", (int)getuid());
+    mkdir(dir, 0700);
+    struct stat st;
+    if (lstat(dir, &st) == -1 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+        fprintf(stderr, "server: %s is not a private directory of ours\n", dir);
+        return -1;
+    }
+    snprintf(buf, size, "%s/sock", dir);
+    return 0;
+}
+
+// 1 if the process at the other end of conn runs as our user
+int peer_is_us(int conn) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+int run_server(const char* path) {
+    char default_path[108];
+    if (path == NULL)
+        path = getenv("SHELL_SOCKET");
+    if (path == NULL || *path == '\0') {
+        if (server_default_path(default_path, sizeof(default_path)) == -1)
+            return 1;
+        path = default_path;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "server: socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t old_mask = umask(077);  // only this user may connect
+    unlink(path);
+    if (sock == -1 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(sock, 64) == -1) {
+        perror("server");
+        return 1;
+    }
+    umask(old_mask);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "server: listening on %s\n", path);
+
+    while (1) {
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno != EINTR)
+                perror("server: accept");
+            continue;
+        }
+        if (!peer_is_us(conn)) {
+            close(conn);
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+            signal(SIGPIPE, SIG_DFL);
+            server_handle(conn);
+        }
+        if (pid == -1)
+            perror("server: fork");
+        close(conn);  // finished children are reaped by sigchld_handler
+    }
+}
+
+// ---------------------------------------------------------------------------
+// zygote (SHELL_ZYGOTE=N)
+//
+// Forked right at startup, while the shell is still small, the zygote keeps a
+// pool of N children blocked in recvmsg() on a SOCK_SEQPACKET socket. To run
+// a command the shell sends argv plus its stdin/stdout/stderr; whichever pool
+// child receives it reports its pid and execs. The zygote reaps it, reports
+// the exit status and forks a replacement. Launch cost therefore no longer
+// grows with the shell's heap (history, job buffers, glob cache), which
+// fork() has to copy page tables for. "zygote bench" compares both paths.
+// The pool only has the shell's state from startup, so the trace ring is
+// mapped before the zygote is forked and each request carries the current
+// trace-perf setting.
+// ---------------------------------------------------------------------------
+
+#define ZYGOTE_DEFAULT_POOL 4
+#define ZYGOTE_MAX_MSG (128 * 1024)
+
+enum { ZYGOTE_STARTED, ZYGOTE_EXITED };
+
+typedef struct {
+    int type;
+    pid_t pid;
+    int status;
+} ZygoteReply;
+
+// pool child: wait for one request, report in and exec it
+void zygote_child(int sock) {
+    static char buf[ZYGOTE_MAX_MSG];
+    union {
+        struct cmsghdr hdr;
+        char ctl[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    struct iovec iov = { buf, sizeof(buf) - 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.ctl;
+    msg.msg_controllen = sizeof(ctl.ctl);
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, 0)) == -1 && errno == EINTR)
+        ;
+    if (n <= 0)
+        _exit(0);  // the shell has gone away
+
+    ZygoteReply started = { ZYGOTE_STARTED, getpid(), 0 };
+    send(sock, &started, sizeof(started), 0);
+
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    if (c != NULL && c->cmsg_type == SCM_RIGHTS) {
+        int* fds = (int*)CMSG_DATA(c);
+        for (int i = 0; i < 3; i++) {
+            dup2(fds[i], i);
+            if (fds[i] > 2)
+                close(fds[i]);
+        }
+    }
+    close(sock);
+
+    // the trace-perf flag, then argv strings back to back, ending with an empty string
+    buf[n] = '\0';
+    trace_enabled = buf[0] == 'T' && trace_ring != NULL;
+    StrVec argv = { NULL, 0, 0 };
+    for (char* p = buf + 1; p < buf + n && *p; p += strlen(p) + 1)
+        strvec_push(&argv, p);
+    strvec_push(&argv, NULL);
+
+    prctl(PR_SET_PDEATHSIG, 0);
+    signal(SIGCHLD, SIG_DFL);
+    exec_traced(argv.items);
+    perror("Command not found...");
+    _exit(1);
+}
+
+void zygote_main(int sock, int pool) {
+    // nothing else of the shell is needed here; go away with it
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGCHLD, SIG_DFL);
+    int alive = 0;
+
+    while (1) {
+        while (alive < pool) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                zygote_child(sock);
+            }
+            if (pid == -1) {
+                sleep(1);
+                break;
+            }
+            alive++;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1)
+            continue;
+        alive--;
+        ZygoteReply exited = { ZYGOTE_EXITED, pid, status };
+        if (send(sock, &exited, sizeof(exited), MSG_NOSIGNAL) == -1 && errno == EPIPE)
+            _exit(0);
+    }
+}
+
+// starts the zygote if SHELL_ZYGOTE is set (its value is the pool size)
+void zygote_init(void) {
+    const char* env = getenv("SHELL_ZYGOTE");
+    if (env == NULL || *env == '\0' || strcmp(env, "0") == 0)
+        return;
+    int pool = atoi(env) > 0 ? atoi(env) : ZYGOTE_DEFAULT_POOL;
+    trace_map();  // so set -o trace-perf later still reaches pool children
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("zygote: socketpair");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("zygote: fork");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_main(sv[1], pool);
+    }
+    close(sv[1]);
+    zygote_fd = sv[0];
+}
+
+// runs arglist in a pool child with the shell's current stdin/stdout/stderr
+// and waits for it. Returns the wait status, or -1 if the zygote couldn't
+// take the request (the caller then forks as usual)
+int zygote_run(char** arglist) {
+    static char buf[ZYGOTE_MAX_MSG];
+    before_fork();
+    buf[0] = trace_enabled ? 'T' : '-';
+    size_t n = 1;
+    for (int i = 0; arglist[i] != NULL; i++) {
+        size_t len = strlen(arglist[i]) + 1;
+        if (n + len + 1 > sizeof(buf))
+            return -1;
+        memcpy(buf + n, arglist[i], len);
+        n += len;
+    }
+    buf[n++] = '\0';
+
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    union {
+        struct cmsghdr hdr;
+        char ctl[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    struct iovec iov = { buf, n };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.ctl;
+    msg.msg_controllen = sizeof(ctl.ctl);
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    long long t0 = trace_now();
+    if (sendmsg(zygote_fd, &msg, MSG_NOSIGNAL) == -1) {
+        if (errno == EPIPE) {
+            close(zygote_fd);  // zygote died; fall back to fork() from now on
+            zygote_fd = -1;
+        }
+        return -1;
+    }
+
+    // first our child's pid, then (possibly after stale exits of idle pool
+    // children) its exit status
+    pid_t pid = -1;
+    ZygoteReply r;
+    while (1) {
+        ssize_t got = recv(zygote_fd, &r, sizeof(r), 0);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got != sizeof(r)) {
+            close(zygote_fd);
+            zygote_fd = -1;
+            return 1 << 8;
+        }
+        if (r.type == ZYGOTE_STARTED && pid == -1) {
+            pid = r.pid;
+            trace_event("zygote_spawn", t0, trace_now());
+        } else if (r.type == ZYGOTE_EXITED && r.pid == pid) {
+            return r.status;
+        }
+    }
+}
+
+int compare_ll(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// zygote bench [runs] [heap MB]: launch+reap latency of /bin/true, plain
+// fork() against the zygote, optionally with the shell's heap inflated first
+void zygote_bench(int runs, int heap_mb) {
+    char* argv[] = { "true", NULL };
+    long long* fork_ns = malloc(sizeof(long long) * runs);
+    long long* zyg_ns = malloc(sizeof(long long) * runs);
+    struct timespec a, b;
+
+    // touch every page so fork() really has to copy the page tables
+    char* heap = heap_mb > 0 ? malloc((size_t)heap_mb << 20) : NULL;
+    if (heap != NULL)
+        memset(heap, 1, (size_t)heap_mb << 20);
+
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    for (int i = 0; i < runs; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        pid_t pid = spawn(argv, -1, -1, -1);
+        waitpid(pid, NULL, 0);
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        fork_ns[i] = (b.tv_sec - a.tv_sec) * 1000000000LL + (b.tv_nsec - a.tv_nsec);
+
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        zygote_run(argv);
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        zyg_ns[i] = (b.tv_sec - a.tv_sec) * 1000000000LL + (b.tv_nsec - a.tv_nsec);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    qsort(fork_ns, runs, sizeof(long long), compare_ll);
+    qsort(zyg_ns, runs, sizeof(long long), compare_ll);
+    printf("%d runs of true, %d MB extra heap\n", runs, heap_mb);
+    printf("fork:   p50 %7.1f us  p99 %7.1f us\n", fork_ns[runs / 2] / 1000.0, fork_ns[runs * 99 / 100] / 1000.0);
+    printf("zygote: p50 %7.1f us  p99 %7.1f us\n", zyg_ns[runs / 2] / 1000.0, zyg_ns[runs * 99 / 100] / 1000.0);
+
+    free(heap);
+    free(fork_ns);
+    free(zyg_ns);
+}
+
+// ---------------------------------------------------------------------------
+// read [-r] [name...] and while loops
+//
+// POSIX read may not consume past the newline, because whoever reads the
+// same stdin next must start at the following line. On a pipe or terminal
+// that forces one read() per byte. On a regular file we can read a big
+// block and lseek() back over what wasn't used. Inside
+// "while ...; do ...; done < file" the loop owns the descriptor, so the
+// block stays buffered across iterations and the offset is only put right
+// before another command could see the file (read_sync()). Line ends are
+// found with memchr() and fields with strspn()/strcspn(), which glibc
+// implements with SSE2/AVX2.
+// ---------------------------------------------------------------------------
+
+#define READ_BUF_SIZE (128 * 1024)
+
+typedef struct {
+    char* buf;
+    size_t pos;     // next unread byte
+    size_t len;     // bytes in buf
+    size_t cap;
+    int owned;      // stdin belongs to a while loop, keep the buffer
+} LineReader;
+
+LineReader stdin_reader = { NULL, 0, 0, 0, 0 };
+
+// gives unread buffered bytes back to stdin so other readers see them
+void read_sync(void) {
+    LineReader* r = &stdin_reader;
+    if (r->len > r->pos)
+        lseek(STDIN_FILENO, -(off_t)(r->len - r->pos), SEEK_CUR);
+    r->pos = r->len = 0;
+}
+
+// gives back what is buffered and sets whether a while loop owns stdin;
+// returns the previous setting
+int read_set_owned(int owned) {
+    int old = stdin_reader.owned;
+    read_sync();
+    stdin_reader.owned = owned;
+    return old;
+}
+
+// called before any child is started: it must not inherit our unflushed
+// stdout buffer or find stdin positioned past what read has consumed
+void before_fork(void) {
+    fflush(stdout);
+    read_sync();
+}
+
+// reads one line from stdin without the newline; returns its length, or -1
+// at end of input with nothing read. *line stays valid until the next call
+ssize_t read_line(char** line) {
+    static char* slow = NULL;
+    static size_t slow_cap = 0;
+    LineReader* r = &stdin_reader;
+    struct stat st;
+
+    if (!r->owned && (fstat(STDIN_FILENO, &st) == -1 || !S_ISREG(st.st_mode))) {
+        // somebody else may read this stdin after us: one byte at a time
+        size_t n = 0;
+        char c;
+        ssize_t got;
+        while ((got = read(STDIN_FILENO, &c, 1)) == 1 || (got == -1 && errno == EINTR)) {
+            if (got == -1)
+                continue;
+            if (c == '\n')
+                break;
+            if (n + 1 >= slow_cap)
+                slow = realloc(slow, slow_cap = slow_cap ? slow_cap * 2 : 256);
+            slow[n++] = c;
+        }
+        if (got != 1 && n == 0)
+            return -1;
+        if (slow == NULL)
+            slow = malloc(slow_cap = 256);
+        slow[n] = '\0';
+        *line = slow;
+        return n;
+    }
+
+    if (r->buf == NULL)
+        r->buf = malloc((r->cap = READ_BUF_SIZE) + 1);
+    char* nl;
+    while ((nl = memchr(r->buf + r->pos, '\n', r->len - r->pos)) == NULL) {
+        // move the partial line to the front (or grow for very long lines) and refill
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+        if (r->len == r->cap)
+            r->buf = realloc(r->buf, (r->cap *= 2) + 1);
+        ssize_t got = read(STDIN_FILENO, r->buf + r->len, r->cap - r->len);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            if (r->len == 0)
+                return -1;
+            nl = r->buf + r->len;   // last line without a newline
+            r->buf[r->len] = '\n';
+            r->len++;
+            break;
+        }
+        r->len += got;
+    }
+
+    *line = r->buf + r->pos;
+    size_t n = nl - *line;
+    *nl = '\0';
+    r->pos += n + 1;
+    if (!r->owned)
+        read_sync();
+    return n;
+}
+
+// the read builtin; sets last_status to 1 at end of input
+void builtin_read(char** arglist) {
+    int raw = 0, a = 1;
+    if (arglist[a] != NULL && strcmp(arglist[a], "-r") == 0) {
+        raw = 1;
+        a++;
+    }
+
+    char* line;
+    ssize_t n = read_line(&line);
+    if (n == -1) {
+        last_status = 1;
+        return;
+    }
+
+    if (!raw) {
+        // without -r a backslash quotes the next character
+        char* w = line;
+        for (char* p = line; *p; p++) {
+            if (*p == '\\' && p[1])
+                p++;
+            *w++ = *p;
+        }
+        *w = '\0';
+    }
+
+    const char* ifs = get_var("IFS");
+    if (ifs == NULL)
+        ifs = " \t\n";
+    if (arglist[a] == NULL) {
+        set_var("REPLY", line);
+        return;
+    }
+
+    // every name but the last takes one field; the last takes the rest of the line
+    char* p = line;
+    for (; arglist[a] != NULL; a++) {
+        p += strspn(p, ifs);
+        if (arglist[a + 1] == NULL) {
+            size_t len = strlen(p);
+            while (len > 0 && strchr(ifs, p[len - 1]) != NULL)
+                len--;
+            p[len] = '\0';
+            set_var(arglist[a], p);
+            break;
+        }
+        size_t len = strcspn(p, ifs);
+        char save = p[len];
+        p[len] = '\0';
+        set_var(arglist[a], p);
+        p[len] = save;
+        p += len;
+    }
+}
+
+// cuts s at the next ';' and returns what follows (NULL if there is none)
+char* split_semicolon(char* s) {
+    char* semi = strchr(s, ';');
+    if (semi == NULL)
+        return NULL;
+    *semi = '\0';
+    return semi + 1;
+}
+
+char* trim(char* s) {
+    while (isspace((unsigned char)*s))
+        s++;
+    size_t len = strlen(s);
+    while (len > 0 && isspace((unsigned char)s[len - 1]))
+        s[--len] = '\0';
+    return s;
+}
+
+// while CONDITION; do COMMAND; ...; done [< file]
+// (one level only: the body can't contain another while)
+int run_while(char* line) {
+    char* rest = split_semicolon(line);
+    char* cond = trim(line);
+    StrVec body = { NULL, 0, 0 };
+    char* redirect = NULL;
+    int ok = 0;
+
+    for (char* part = rest; part != NULL; part = rest) {
+        rest = split_semicolon(part);
+        part = trim(part);
+        if (body.count == 0 && !ok) {
+            if (strncmp(part, "do", 2) != 0 || (part[2] && !isspace((unsigned char)part[2])))
+                break;
+            part = trim(part + 2);
+            ok = 1;
+        }
+        if (strncmp(part, "done", 4) == 0 && (part[4] == '\0' || isspace((unsigned char)part[4]) || part[4] == '<')) {
+            redirect = trim(part + 4);
+            ok = 2;
+            break;
+        }
+        if (*part)
+            strvec_push(&body, part);
+    }
+    if (ok != 2 || *cond == '\0' || (*redirect && (redirect[0] != '<' || !*trim(redirect + 1)))) {
+        fprintf(stderr, "while: usage: while command; do command; ...; done [< file]\n");
+        free(body.items);
+        return last_status = 2;
+    }
+
+    int saved_stdin = -1;
+    if (*redirect) {
+        const char* path = trim(redirect + 1);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror(path);
+            free(body.items);
+            return last_status = 1;
+        }
+        read_sync();
+        saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+        stdin_reader.owned = 1;
+    }
+
+    // "read ..." conditions are tokenized once and called directly
+    char* cond_copy = strdup(cond);
+    char** read_args = NULL;
+    if (strncmp(cond, "read", 4) == 0 && (cond[4] == '\0' || isspace((unsigned char)cond[4])))
+        read_args = tokenize(cond_copy);
+
+    int status = 0;
+    while (1) {
+        if (read_args != NULL) {
+            last_status = 0;
+            builtin_read(read_args);
+        } else {
+            strcpy(cond_copy, cond);
+            run_command_line(cond_copy);
+        }
+        if (last_status != 0)
+            break;
+        for (int i = 0; i < body.count; i++) {
+            char* cmd = strdup(body.items[i]);
+            status = run_command_line(cmd);
+            free(cmd);
+        }
+    }
+
+    if (read_args != NULL) {
+        for (int i = 0; read_args[i] != NULL; i++)
+            free(read_args[i]);
+        free(read_args);
+    }
+    free(cond_copy);
+    free(body.items);
+    if (saved_stdin != -1) {
+        stdin_reader.owned = 0;
+        stdin_reader.pos = stdin_reader.len = 0;
+        dup2(saved_stdin, STDIN_FILENO);
+        close(saved_stdin);
+    }
+    return last_status = status;
+}
+
+// ---------------------------------------------------------------------------
+// $(( )) arithmetic
+//
+// An expression is compiled once into postfix code for a small stack
+// machine, and the code is cached by expression text, so i=$((i + 1)) in a
+// loop is parsed on the first iteration only. Integers are 64-bit and C
+// precedence applies. Operators: unary - + ! ~, * / %, + -, << >>,
+// < <= > >=, == !=, &, ^, |, && and ||. Names and $names read shell
+// variables; unset or empty ones count as 0. && and || short-circuit: the
+// left operand is followed by a conditional jump over the right one, so
+// "x != 0 && 10 / x" never divides by zero.
+// ---------------------------------------------------------------------------
+
+#define ARITH_CACHE_SIZE 64
+
+enum {
+    A_NUM, A_VAR, A_NEG, A_NOT, A_BNOT, A_BOOL,
+    A_MUL, A_DIV, A_MOD, A_ADD, A_SUB, A_SHL, A_SHR,
+    A_LT, A_LE, A_GT, A_GE, A_EQ, A_NE, A_BAND, A_XOR, A_BOR,
+    A_AND, A_OR,     // only in the parser; compiled to the jumps below
+    A_JZ, A_JNZ      // top is 0 / not 0: make it 0 / 1 and jump, else pop it
+};
+
+typedef struct {
+    int op;
+    long long num;   // A_NUM; jump target for A_JZ/A_JNZ
+    char* name;      // A_VAR
+} ArithInsn;
+
+typedef struct {
+    char* src;       // NULL = empty cache slot
+    ArithInsn* code;
+    int n;
+    int error;       // expression didn't parse
+} ArithProg;
+
+typedef struct {
+    const char* p;
+    ArithProg* prog;
+    int cap;
+} ArithParser;
+
+// binary operators, two-character ones first so "<<" wins over "<"
+struct {
+    const char* str;
+    int prec;
+    int op;
+} arith_ops[] = {
+    { "<<", 8, A_SHL }, { ">>", 8, A_SHR }, { "<=", 7, A_LE }, { ">=", 7, A_GE },
+    { "==", 6, A_EQ }, { "!=", 6, A_NE }, { "&&", 2, A_AND }, { "||", 1, A_OR },
+    { "*", 10, A_MUL }, { "/", 10, A_DIV }, { "%", 10, A_MOD }, { "+", 9, A_ADD },
+    { "-", 9, A_SUB }, { "<", 7, A_LT }, { ">", 7, A_GT }, { "&", 5, A_BAND },
+    { "^", 4, A_XOR }, { "|", 3, A_BOR }, { NULL, 0, 0 }
+};
+
+ArithProg arith_cache[ARITH_CACHE_SIZE];
+
+void arith_emit(ArithParser* ap, int op, long long num, char* name) {
+    ArithProg* prog = ap->prog;
+    if (prog->n == ap->cap) {
+        ap->cap = ap->cap ? ap->cap * 2 : 16;
+        prog->code = realloc(prog->code, sizeof(ArithInsn) * ap->cap);
+    }
+    prog->code[prog->n].op = op;
+    prog->code[prog->n].num = num;
+    prog->code[prog->n].name = name;
+    prog->n++;
+}
+
+void arith_binary(ArithParser* ap, int min_prec);
+
+void arith_unary(ArithParser* ap) {
+    while (isspace((unsigned char)*ap->p))
+        ap->p++;
+    char c = *ap->p;
+    if (c == '-' || c == '+' || c == '!' || c == '~') {
+        ap->p++;
+        arith_unary(ap);
+        if (c != '+')
+            arith_emit(ap, c == '-' ? A_NEG : c == '!' ? A_NOT : A_BNOT, 0, NULL);
+    } else if (c == '(') {
+        ap->p++;
+        arith_binary(ap, 0);
+        while (isspace((unsigned char)*ap->p))
+            ap->p++;
+        if (*ap->p != ')')
+            ap->prog->error = 1;
+        else
+            ap->p++;
+    } else if (isdigit((unsigned char)c)) {
+        char* end;
+        long long num = strtoll(ap->p, &end, 0);
+        ap->p = end;
+        arith_emit(ap, A_NUM, num, NULL);
+    } else if (isalpha((unsigned char)c) || c == '_' || c == '$') {
+        if (c == '$')
+            ap->p++;
+        const char* name = ap->p;
+        while (isalnum((unsigned char)*ap->p) || *ap->p == '_')
+            ap->p++;
+        if (ap->p == name)
+            ap->prog->error = 1;
+        arith_emit(ap, A_VAR, 0, strndup(name, ap->p - name));
+    } else {
+        ap->prog->error = 1;
+    }
+}
+
+void arith_binary(ArithParser* ap, int min_prec) {
+    arith_unary(ap);
+    while (!ap->prog->error) {
+        while (isspace((unsigned char)*ap->p))
+            ap->p++;
+        int i = 0;
+        while (arith_ops[i].str != NULL && strncmp(ap->p, arith_ops[i].str, strlen(arith_ops[i].str)) != 0)
+            i++;
+        if (arith_ops[i].str == NULL || arith_ops[i].prec < min_prec)
+            return;
+        ap->p += strlen(arith_ops[i].str);
+        int op = arith_ops[i].op;
+        if (op == A_AND || op == A_OR) {
+            int jump = ap->prog->n;
+            arith_emit(ap, op == A_AND ? A_JZ : A_JNZ, 0, NULL);
+            arith_binary(ap, arith_ops[i].prec + 1);
+            arith_emit(ap, A_BOOL, 0, NULL);
+            ap->prog->code[jump].num = ap->prog->n;
+            continue;
+        }
+        arith_binary(ap, arith_ops[i].prec + 1);  // all binary operators are left-associative
+        arith_emit(ap, op, 0, NULL);
+    }
+}
+
+ArithProg* arith_compile(const char* expr) {
+    ArithProg* prog = &arith_cache[hash_str(expr) % ARITH_CACHE_SIZE];
+    if (prog->src != NULL && strcmp(prog->src, expr) == 0)
+        return prog;
+
+    // evict whatever was in this slot
+    for (int i = 0; i < prog->n; i++)
+        free(prog->code[i].name);
+    free(prog->code);
+    free(prog->src);
+    memset(prog, 0, sizeof(ArithProg));
+
+    ArithParser ap = { expr, prog, 0 };
+    prog->src = strdup(expr);
+    arith_binary(&ap, 0);
+    while (isspace((unsigned char)*ap.p))
+        ap.p++;
+    if (*ap.p != '\0' || prog->n == 0)
+        prog->error = 1;
+    return prog;
+}
+
+// evaluates expr; returns -1 (and prints why) if it is malformed, divides by
+// zero, overflows a division or shifts by a negative count or one >= 64.
+// + - * wrap around in two's complement, as in bash
+int arith_eval(const char* expr, long long* result) {
+    ArithProg* prog = arith_compile(expr);
+    if (prog->error) {
+        fprintf(stderr, "arithmetic: syntax error: %s\n", expr);
+        return -1;
+    }
+
+    long long small[32] = { 0 };
+    long long* stack = prog->n <= 32 ? small : malloc(sizeof(long long) * prog->n);
+    int sp = 0;
+    for (int i = 0; i < prog->n; i++) {
+        ArithInsn* in = &prog->code[i];
+        if (in->op == A_NUM) {
+            stack[sp++] = in->num;
+            continue;
+        }
+        if (in->op == A_VAR) {
+            const char* v = get_var(in->name);
+            stack[sp++] = v ? strtoll(v, NULL, 0) : 0;
+            continue;
+        }
+        if (in->op <= A_BOOL) {
+            long long* x = &stack[sp - 1];
+            *x = in->op == A_NEG ? (long long)(0ULL - *x) : in->op == A_NOT ? !*x
+               : in->op == A_BOOL ? *x != 0 : ~*x;
+            continue;
+        }
+        if (in->op == A_JZ || in->op == A_JNZ) {
+            long long* x = &stack[sp - 1];
+            if ((*x != 0) == (in->op == A_JNZ)) {
+                *x = *x != 0;
+                i = in->num - 1;
+            } else {
+                sp--;
+            }
+            continue;
+        }
+        long long b = stack[--sp];
+        long long* a = &stack[sp - 1];
+        const char* error = NULL;
+        switch (in->op) {
+            case A_MUL: *a = (long long)((unsigned long long)*a * b); break;
+            case A_DIV:
+            case A_MOD:
+                if (b == 0)
+                    error = "division by zero";
+                else if (*a == LLONG_MIN && b == -1)
+                    error = "division overflow";
+                else
+                    *a = in->op == A_DIV ? *a / b : *a % b;
+                break;
+            case A_ADD: *a = (long long)((unsigned long long)*a + b); break;
+            case A_SUB: *a = (long long)((unsigned long long)*a - b); break;
+            case A_SHL:
+            case A_SHR:
+                if (b < 0 || b >= 64)
+                    error = "shift count out of range";
+                else if (in->op == A_SHL)
+                    *a = (long long)((unsigned long long)*a << b);
+                else
+                    *a >>= b;
+                break;
+            case A_LT: *a = *a < b; break;
+            case A_LE: *a = *a <= b; break;
+            case A_GT: *a = *a > b; break;
+            case A_GE: *a = *a >= b; break;
+            case A_EQ: *a = *a == b; break;
+            case A_NE: *a = *a != b; break;
+            case A_BAND: *a &= b; break;
+            case A_XOR: *a ^= b; break;
+            case A_BOR: *a |= b; break;
+        }
+        if (error != NULL) {
+            fprintf(stderr, "arithmetic: %s: %s\n", error, expr);
+            if (stack != small)
+                free(stack);
+            return -1;
+        }
+    }
+    *result = stack[0];
+    if (stack != small)
+        free(stack);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// ${...} parameter operations
+//
+//   ${#v}               length
+//   ${v:-word}          word if v is unset or empty
+//   ${v:off} ${v:off:len}  substring (off and len are arithmetic; a
+//                       negative off counts from the end)
+//   ${v#pat} ${v##pat}  remove shortest/longest matching prefix
+//   ${v%pat} ${v%%pat}  remove shortest/longest matching suffix
+//   ${v/pat/s} ${v//pat/s}  replace first/every match
+//
+// Patterns are globs compiled with pattern_compile(). Patterns without
+// wildcards skip the matcher: prefixes and suffixes are compared with
+// memcmp() and replacements are found with memmem(), glibc's vectorized
+// substring search.
+// ---------------------------------------------------------------------------
+
+void buf_append(char** out, size_t* n, size_t* cap, const char* s, size_t len) {
+    if (*n + len + 1 > *cap) {
+        *cap = (*n + len + 1) * 2;
+        *out = realloc(*out, *cap);
+    }
+    memcpy(*out + *n, s, len);
+    *n += len;
+    (*out)[*n] = '\0';
+}
+
+// removes a prefix (suffix = 0) or suffix matching pat; longest or shortest
+char* param_trim(const char* v, const char* pat, int suffix, int longest) {
+    size_t n = strlen(v);
+    if (!has_glob_meta(pat)) {
+        char* lit = unescape(pat, strlen(pat));
+        size_t len = strlen(lit);
+        int hit = len <= n && memcmp(suffix ? v + n - len : v, lit, len) == 0;
+        free(lit);
+        return hit ? strndup(suffix ? v : v + len, n - len) : strdup(v);
+    }
+
+    Pattern p;
+    pattern_compile(&p, pat);
+    p.leading_dot = 1;  // the hidden-file rule is for filenames only
+    size_t cut = 0;
+    int found = 0;
+    for (size_t k = 0; k <= n && !found; k++) {
+        size_t len = longest ? n - k : k;   // candidate length of the removed part
+        if (pattern_match(&p, suffix ? v + n - len : v, len)) {
+            cut = len;
+            found = 1;
+        }
+    }
+    pattern_free(&p);
+    return suffix ? strndup(v, n - cut) : strdup(v + cut);
+}
+
+// can a match of p begin with byte c? (looks at the first op only)
+int pattern_can_start(const Pattern* p, unsigned char c) {
+    if (p->nops == 0)
+        return 0;
+    const PatOp* op = &p->ops[0];
+    if (op->type == PAT_LITERAL)
+        return (unsigned char)op->lit[0] == c;
+    if (op->type == PAT_CLASS)
+        return (op->set[c >> 3] & (1 << (c & 7))) != 0;
+    return 1;
+}
+
+char* param_replace(const char* v, const char* pat, const char* rep, int all) {
+    size_t n = strlen(v), cap = n + 1, outn = 0;
+    char* out = malloc(cap);
+    out[0] = '\0';
+    size_t rlen = strlen(rep);
+
+    if (!has_glob_meta(pat)) {
+        char* lit = unescape(pat, strlen(pat));
+        size_t len = strlen(lit);
+        const char* p = v;
+        const char* hit;
+        while (len > 0 && (hit = memmem(p, v + n - p, lit, len)) != NULL) {
+            buf_append(&out, &outn, &cap, p, hit - p);
+            buf_append(&out, &outn, &cap, rep, rlen);
+            p = hit + len;
+            if (!all)
+                break;
+        }
+        buf_append(&out, &outn, &cap, p, v + n - p);
+        free(lit);
+        return out;
+    }
+
+    Pattern p;
+    pattern_compile(&p, pat);
+    p.leading_dot = 1;
+    // without a '*' every match is exactly min_len bytes long
+    int has_star = 0;
+    for (int k = 0; k < p.nops; k++)
+        has_star |= p.ops[k].type == PAT_STAR;
+    size_t i = 0, done = 0;
+    while (i < n && !done) {
+        // longest match starting at i, once the first op accepts v[i]
+        size_t len = 0;
+        if (pattern_can_start(&p, (unsigned char)v[i])) {
+            if (!has_star) {
+                if ((size_t)p.min_len <= n - i && pattern_match(&p, v + i, p.min_len))
+                    len = p.min_len;
+            } else {
+                len = n - i;
+                while (len > 0 && len >= (size_t)p.min_len && !pattern_match(&p, v + i, len))
+                    len--;
+                if (len < (size_t)p.min_len)
+                    len = 0;
+            }
+        }
+        if (len == 0) {
+            buf_append(&out, &outn, &cap, v + i, 1);
+            i++;
+            continue;
+        }
+        buf_append(&out, &outn, &cap, rep, rlen);
+        i += len;
+        done = !all;
+    }
+    buf_append(&out, &outn, &cap, v + i, n - i);
+    pattern_free(&p);
+    return out;
+}
+
+// expands the inside of ${...}; returns a new string
+char* expand_param(const char* inner) {
+    int length = 0;
+    if (inner[0] == '#' && inner[1] != '\0') {
+        length = 1;
+        inner++;
+    }
+
+    const char* p = inner;
+    if (*p == '?')
+        p++;
+    else
+        while (isalnum((unsigned char)*p) || *p == '_')
+            p++;
+    char name[256];
+    snprintf(name, sizeof(name), "%.*s", (int)(p - inner), inner);
+    char status[24];
+    snprintf(status, sizeof(status), "%d", last_status);
+    const char* v = strcmp(name, "?") == 0 ? status : get_var(name);
+    if (v == NULL)
+        v = "";
+
+    if (name[0] == '\0' || (length && *p != '\0')) {
+        fprintf(stderr, "${%s}: bad substitution\n", inner);
+        return strdup("");
+    }
+    if (length) {
+        snprintf(status, sizeof(status), "%zu", strlen(v));
+        return strdup(status);
+    }
+    if (*p == '\0')
+        return strdup(v);
+
+    // everything after the operator may itself contain expansions
+    char op = *p++;
+    int twice = (*p == op && (op == '#' || op == '%' || op == '/'));
+    if (twice)
+        p++;
+    char* arg = strdup(p);
+
+    char* result;
+    if (op == ':' && arg[0] == '-') {
+        result = *v ? strdup(v) : expand_vars(arg + 1);
+    } else if (op == ':') {
+        char* len_part = strchr(arg, ':');
+        if (len_part != NULL)
+            *len_part++ = '\0';
+        long long off = 0, len = strlen(v), n = strlen(v);
+        // an expansion that already failed has printed why
+        char* e = expand_vars(arg);
+        int bad = expand_error || arith_eval(e, &off) == -1;
+        free(e);
+        if (!bad && len_part != NULL) {
+            e = expand_vars(len_part);
+            bad = expand_error || arith_eval(e, &len) == -1;
+            free(e);
+        }
+        if (bad)
+            expand_error = 1;
+        if (off < 0)
+            off += n;
+        if (off < 0 || off > n || bad)
+            off = n;
+        if (len < 0)
+            len = n - off + len;  // negative length: stop that far from the end
+        if (len < 0)
+            len = 0;
+        if (off + len > n)
+            len = n - off;
+        result = strndup(v + off, len);
+    } else if (op == '#' || op == '%') {
+        char* pat = expand_vars(arg);
+        result = param_trim(v, pat, op == '%', twice);
+        free(pat);
+    } else if (op == '/') {
+        char* slash = arg;
+        while (*slash && *slash != '/')
+            slash += (*slash == '\\' && slash[1]) ? 2 : 1;
+        char* rep = *slash ? slash + 1 : "";
+        *slash = '\0';
+        char* pat = expand_vars(arg);
+        char* with = expand_vars(rep);
+        result = *pat ? param_replace(v, pat, with, twice) : strdup(v);
+        free(pat);
+        free(with);
+    } else {
+        fprintf(stderr, "${%s}: bad substitution\n", inner);
+        result = strdup("");
+    }
+    free(arg);
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// pipeline monitor (set -o pipemon)
+//
+// Instead of blocking in waitpid(), handle_pipes() hands the stages to
+// monitor_pipeline(), which keeps its own copy of every pipe's read end and
+// every PIPEMON_INTERVAL_MS samples:
+//   - how full each pipe is: FIONREAD against F_GETPIPE_SZ
+//   - each stage's state and CPU ticks from /proc/<pid>/stat
+//   - each stage's rchar/wchar from /proc/<pid>/io, for throughput
+// A sleeping stage whose output pipe is full is blocked on write; one whose
+// input pipe is empty is blocked on read. The live view goes to stderr when
+// it's a terminal; the summary is printed when the last stage exits.
+// The read end of a pipe is closed as soon as the stage reading it exits, so
+// the writer still gets EPIPE/SIGPIPE.
+// ---------------------------------------------------------------------------
+
+// trace_now() reads 0 unless tracing is on
+long long pipemon_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+typedef struct {
+    pid_t pid;
+    char name[24];
+    int done;
+    int status;
+    long long start_ns, end_ns;
+    unsigned long long ticks;          // utime + stime at the last sample
+    unsigned long long rchar, wchar;   // at the last sample
+    double cpu, out_rate;              // over the last interval
+    char state;                        // R, S, D ... from /proc/<pid>/stat
+    const char* blocked;               // "read", "write" or NULL
+    int samples, busy, blocked_read, blocked_write;
+    struct timeval ru_time;            // exact CPU time, from wait4()
+} PipeStage;
+
+// state and utime + stime from /proc/<pid>/stat; the command name may hold
+// spaces and parens, so fields are counted from the last ')'
+int read_proc_stat(pid_t pid, char* state, unsigned long long* ticks) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    char* p = strrchr(buf, ')');
+    if (p == NULL || p[1] == '\0')
+        return -1;
+    *state = p[2];
+    // after the state come ppid ... stime: utime is field 14, stime 15
+    unsigned long long utime, stime;
+    if (sscanf(p + 4, "%*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+               &utime, &stime) != 2)
+        return -1;
+    *ticks = utime + stime;
+    return 0;
+}
+
+int read_proc_io(pid_t pid, unsigned long long* rchar, unsigned long long* wchar) {
+    char path[64], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/io", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    return sscanf(buf, "rchar: %llu\nwchar: %llu", rchar, wchar) == 2 ? 0 : -1;
+}
+
+// 1536 -> "1.5K"
+const char* human_bytes(double n, char* buf, size_t size) {
+    const char* units = "BKMGT";
+    int u = 0;
+    while (n >= 1024 && units[u + 1]) {
+        n /= 1024;
+        u++;
+    }
+    snprintf(buf, size, u ? "%.1f%c" : "%.0f%c", n, units[u]);
+    return buf;
+}
+
+// one line per stage, redrawn in place
+void pipemon_draw(PipeStage* st, int n, int* fill, int* cap, int redraw) {
+    if (redraw)
+        fprintf(stderr, "\033[%dA", n);
+    for (int i = 0; i < n; i++) {
+        char rate[16], total[16], queued[16], size[16];
+        fprintf(stderr, "\r\033[K%d %-16.16s ", i + 1, st[i].name);
+        if (st[i].done) {
+            fprintf(stderr, "done     %8s out\n",
+                    human_bytes(st[i].wchar, total, sizeof(total)));
+            continue;
+        }
+        const char* what = st[i].blocked ? st[i].blocked
+                         : st[i].state == 'R' ? "running"
+                         : st[i].state == 'D' ? "disk" : "sleeping";
+        fprintf(stderr, "%-8s %8s out %8s/s cpu %3.0f%%", what,
+                human_bytes(st[i].wchar, total, sizeof(total)),
+                human_bytes(st[i].out_rate, rate, sizeof(rate)), st[i].cpu);
+        if (i < n - 1 && fill[i] >= 0)
+            fprintf(stderr, "  | %s/%s", human_bytes(fill[i], queued, sizeof(queued)),
+                    human_bytes(cap[i], size, sizeof(size)));
+        fputc('\n', stderr);
+    }
+}
+
+void pipemon_summary(PipeStage* st, int n, long long start_ns) {
+    double wall = (pipemon_now() - start_ns) / 1e9;
+    int bottleneck = 0;
+    double bottleneck_busy = -1;
+    fprintf(stderr, "pipeline: %.2fs\n", wall);
+    fprintf(stderr, "  # %-16s %8s %9s %8s %6s %6s %6s\n",
+            "stage", "time", "written", "rate", "cpu", "rd-blk", "wr-blk");
+    for (int i = 0; i < n; i++) {
+        PipeStage* s = &st[i];
+        double t = (s->end_ns - s->start_ns) / 1e9;
+        double cpu = s->ru_time.tv_sec + s->ru_time.tv_usec / 1e6;
+        int k = s->samples ? s->samples : 1;
+        char total[16], rate[16];
+        fprintf(stderr, "  %d %-16.16s %7.2fs %9s %6s/s %5.0f%% %5d%% %5d%%\n",
+                i + 1, s->name, t, human_bytes(s->wchar, total, sizeof(total)),
+                human_bytes(t > 0 ? s->wchar / t : 0, rate, sizeof(rate)),
+                t > 0 ? 100 * cpu / t : 0,
+                100 * s->blocked_read / k, 100 * s->blocked_write / k);
+        // the bottleneck is the stage that was least often waiting on a pipe
+        double busy = s->samples ? (double)s->busy / s->samples : cpu / (t > 0 ? t : 1);
+        if (busy > bottleneck_busy) {
+            bottleneck_busy = busy;
+            bottleneck = i;
+        }
+    }
+    // too short to have been sampled: nothing worth blaming
+    if (st[bottleneck].samples > 0)
+        fprintf(stderr, "  bottleneck: %d (%s)\n", bottleneck + 1, st[bottleneck].name);
+}
+
+// waits for the stages like handle_pipes() would, sampling as it goes;
+// read_fds[i] is a dup of the read end of the pipe between stage i and i+1.
+// SIGCHLD is blocked by the caller. Returns the last stage's wait status.
+int monitor_pipeline(pid_t* pids, char (*names)[24], int n, int* read_fds) {
+    PipeStage st[n];
+    int fill[n], cap[n];
+    memset(st, 0, sizeof(st));
+    long long start = pipemon_now();
+    for (int i = 0; i < n; i++) {
+        st[i].pid = pids[i];
+        snprintf(st[i].name, sizeof(st[i].name), "%s", names[i]);
+        st[i].start_ns = start;
+        cap[i] = i < n - 1 ? fcntl(read_fds[i], F_GETPIPE_SZ) : -1;
+        fill[i] = -1;
+    }
+    int live = 1;
+    int draw = isatty(STDERR_FILENO);
+    int drawn = 0;
+    long clk = sysconf(_SC_CLK_TCK);
+    long long last = start;
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+
+    while (live) {
+        live = 0;
+        for (int i = 0; i < n; i++) {
+            if (st[i].done)
+                continue;
+            // peek first, so the zombie's final byte counts can still be read
+            siginfo_t info;
+            info.si_pid = 0;
+            if (waitid(P_PID, pids[i], &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0) {
+                live++;
+                continue;
+            }
+            read_proc_io(pids[i], &st[i].rchar, &st[i].wchar);
+            struct rusage ru;
+            int status;
+            pid_t r = wait4(pids[i], &status, 0, &ru);
+            if (r == -1) {
+                status = 1 << 8;
+                memset(&ru, 0, sizeof(ru));
+            }
+            st[i].done = 1;
+            st[i].status = status;
+            st[i].end_ns = pipemon_now();
+            timeradd(&ru.ru_utime, &ru.ru_stime, &st[i].ru_time);
+            if (i > 0 && read_fds[i - 1] != -1) {
+                close(read_fds[i - 1]);
+                read_fds[i - 1] = -1;
+                fill[i - 1] = -1;
+            }
+        }
+        if (!live)
+            break;
+
+        long long now = pipemon_now();
+        double dt = (now - last) / 1e9;
+        last = now;
+        for (int i = 0; i < n - 1; i++) {
+            int queued;
+            if (read_fds[i] != -1 && ioctl(read_fds[i], FIONREAD, &queued) == 0)
+                fill[i] = queued;
+        }
+        for (int i = 0; i < n; i++) {
+            PipeStage* s = &st[i];
+            unsigned long long ticks, rchar, wchar;
+            if (s->done || read_proc_stat(s->pid, &s->state, &ticks) == -1)
+                continue;
+            if (read_proc_io(s->pid, &rchar, &wchar) == -1)
+                rchar = s->rchar, wchar = s->wchar;
+            if (dt > 0 && s->samples > 0) {
+                s->cpu = 100.0 * (ticks - s->ticks) / clk / dt;
+                s->out_rate = (wchar - s->wchar) / dt;
+            }
+            s->ticks = ticks;
+            s->rchar = rchar;
+            s->wchar = wchar;
+
+            // a full output pipe is the stronger signal: a stage can have
+            // an empty input only because it's busy writing
+            s->blocked = NULL;
+            if (s->state != 'R') {
+                if (i < n - 1 && fill[i] >= 0 && cap[i] > 0 && fill[i] >= cap[i])
+                    s->blocked = "write";
+                else if (i > 0 && fill[i - 1] == 0)
+                    s->blocked = "read";
+            }
+            s->samples++;
+            if (s->blocked == NULL)
+                s->busy++;
+            else if (s->blocked[0] == 'r')
+                s->blocked_read++;
+            else
+                s->blocked_write++;
+        }
+        if (draw) {
+            pipemon_draw(st, n, fill, cap, drawn);
+            drawn = 1;
+        }
+
+        // sleep until the next sample or until a stage exits
+        struct timespec interval = { 0, PIPEMON_INTERVAL_MS * 1000000L };
+        sigtimedwait(&chld, NULL, &interval);
+    }
+    if (drawn)
+        pipemon_draw(st, n, fill, cap, 1);
+    pipemon_summary(st, n, start);
+    // we may have swallowed a SIGCHLD meant for a background job; raise it
+    // again so the handler runs once the caller unblocks it
+    raise(SIGCHLD);
+    return st[n - 1].status;
 }
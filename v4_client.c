@@ -0,0 +1,130 @@
+/*
+*  Client for v4 --server
+*  usage: v4_client command [args...]
+*         v4_client 'command line'
+*  Several arguments are run as exactly that argv; a single one is a shell
+*  command line (pipes, globs, $vars), as if typed at the v4 prompt.
+*  Sends the arguments, environment and current directory to a running
+*  "v4 --server" together with this process's stdin/stdout/stderr, waits for
+*  the command to finish and exits with its status. Kept free of readline and
+*  everything else so it starts as fast as possible.
+*  The socket is $SHELL_SOCKET, else $XDG_RUNTIME_DIR/newshell.sock, else
+*  /tmp/newshell-<uid>/sock. Nothing is sent unless the server runs as our
+*  own user.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVER_MAGIC 0x76345348u   // must match v4.c
+
+extern char** environ;
+
+// same layout as ServerRequest in v4.c
+typedef struct {
+    unsigned int magic;
+    unsigned int len;
+    unsigned int argc;
+    unsigned int envc;
+} ServerRequest;
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s command [args...]\n", argv[0]);
+        return 2;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    // same default as server_default_path() in v4.c
+    const char* path = getenv("SHELL_SOCKET");
+    const char* run = getenv("XDG_RUNTIME_DIR");
+    if (path != NULL && *path)
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    else if (run != NULL && *run)
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/newshell.sock", run);
+    else
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/newshell-%d/sock", (int)getuid());
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror(addr.sun_path);
+        return 2;
+    }
+
+    // our environment and terminal go to whoever answers: make sure it's us
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 || cred.uid != getuid()) {
+        fprintf(stderr, "%s: %s is not served by our own user\n", argv[0], addr.sun_path);
+        return 2;
+    }
+
+    // payload: cwd, arguments, environment, each NUL-terminated
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        strcpy(cwd, "/");
+    ServerRequest req = { SERVER_MAGIC, 0, argc - 1, 0 };
+    size_t len = strlen(cwd) + 1;
+    for (int i = 1; i < argc; i++)
+        len += strlen(argv[i]) + 1;
+    for (char** e = environ; *e != NULL; e++) {
+        len += strlen(*e) + 1;
+        req.envc++;
+    }
+    req.len = len;
+
+    char* payload = malloc(len);
+    char* p = payload;
+    p = stpcpy(p, cwd) + 1;
+    for (int i = 1; i < argc; i++)
+        p = stpcpy(p, argv[i]) + 1;
+    for (char** e = environ; *e != NULL; e++)
+        p = stpcpy(p, *e) + 1;
+
+    // the header goes out with our stdin/stdout/stderr attached
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, 0) != sizeof(req)) {
+        perror("sendmsg");
+        return 2;
+    }
+    for (size_t sent = 0; sent < len;) {
+        ssize_t w = write(sock, payload + sent, len - sent);
+        if (w <= 0) {
+            perror("write");
+            return 2;
+        }
+        sent += w;
+    }
+
+    int status;
+    if (read(sock, &status, sizeof(status)) != sizeof(status)) {
+        fprintf(stderr, "%s: server closed the connection\n", argv[0]);
+        return 2;
+    }
+    return status;
+}
@@ -5,9 +5,13 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #define MAX_COMMAND_LENGTH 1024
 #define MAX_BACKGROUND_PROCESSES 100
+#define MAX_DIR_CONTEXTS 64   // cached directories
+#define MAX_DIR_STACK 32      // pushd depth
 
 
 // backgorund process tracking
@@ -51,20 +55,300 @@ void kill_job(int job_number) {
 }   // f successful, the function removes the process from the background_processes array, 
     // shifts remaining jobs up in the list, and decrements background_count.
 
+// directory context cache
+//
+// Everything the shell derives from the current directory (canonical path,
+// git repo root and HEAD) is kept per directory, keyed by (device, inode),
+// so cd and the prompt reuse it instead of calling getcwd() and walking up
+// for .git every time. Entries are checked with stat() before use: the path
+// must still name the same inode, and HEAD is reloaded only when its mtime
+// changed.
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;                 // ino 0 = free slot
+    char path[PATH_MAX];
+    int repo_checked;
+    char repo_root[PATH_MAX];  // "" when not inside a git work tree
+    char head_file[PATH_MAX * 2 + 16];  // <gitdir>/HEAD
+    struct timespec head_mtime;
+    char head[256];            // branch name or short commit id
+    unsigned long last_used;
+} DirContext;
+
+DirContext dir_contexts[MAX_DIR_CONTEXTS];
+unsigned long context_clock = 0;
+DirContext* current_dir = NULL;
+char previous_dir[PATH_MAX] = "";  // for cd -
+char* dir_stack[MAX_DIR_STACK];    // pushd/popd
+int dir_stack_count = 0;
+
+int same_time(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// a cached path can go stale if the directory was moved
+int context_path_valid(const DirContext* ctx) {
+    struct stat check;
+    return stat(ctx->path, &check) == 0 && check.st_ino == ctx->ino && check.st_dev == ctx->dev;
+}
+
+// returns the context for the current directory, which st describes; its
+// path is only looked up when the directory isn't cached yet
+DirContext* lookup_context(const struct stat* st) {
+    DirContext* slot = &dir_contexts[0];
+    for (int i = 0; i < MAX_DIR_CONTEXTS; i++) {
+        DirContext* ctx = &dir_contexts[i];
+        if (ctx->ino == st->st_ino && ctx->dev == st->st_dev) {
+            if (context_path_valid(ctx)) {
+                ctx->last_used = ++context_clock;
+                return ctx;
+            }
+            slot = ctx;
+            break;
+        }
+        if (ctx->last_used < slot->last_used)
+            slot = ctx;  // least recently used, free slots first
+    }
+
+    memset(slot, 0, sizeof(DirContext));
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    if (getcwd(slot->path, sizeof(slot->path)) == NULL)
+        snprintf(slot->path, sizeof(slot->path), ".");
+    slot->last_used = ++context_clock;
+    return slot;
+}
+
+// context of the current working directory
+DirContext* cwd_context() {
+    struct stat st;
+    if (stat(".", &st) != 0)
+        return NULL;
+    if (current_dir != NULL && current_dir->ino == st.st_ino && current_dir->dev == st.st_dev &&
+        context_path_valid(current_dir)) {
+        current_dir->last_used = ++context_clock;
+        return current_dir;
+    }
+    current_dir = lookup_context(&st);
+    return current_dir;
+}
+
+// finds the enclosing git work tree and where its HEAD file lives
+void find_repo(DirContext* ctx) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", ctx->path);
+    ctx->repo_checked = 1;
+
+    while (1) {
+        char git[PATH_MAX + 8];
+        struct stat st;
+        snprintf(git, sizeof(git), "%s/.git", strcmp(dir, "/") == 0 ? "" : dir);
+        if (stat(git, &st) == 0) {
+            snprintf(ctx->repo_root, sizeof(ctx->repo_root), "%s", dir);
+            if (S_ISDIR(st.st_mode)) {
+                snprintf(ctx->head_file, sizeof(ctx->head_file), "%s/HEAD", git);
+            } else {
+                // worktrees and submodules: .git is a file saying "gitdir: <path>"
+                char line[PATH_MAX + 16] = "";
+                FILE* fp = fopen(git, "r");
+                if (fp != NULL) {
+                    if (fgets(line, sizeof(line), fp) == NULL)
+                        line[0] = '\0';
+                    fclose(fp);
+                }
+                line[strcspn(line, "\n")] = '\0';
+                const char* gitdir = strncmp(line, "gitdir: ", 8) == 0 ? line + 8 : "";
+                if (gitdir[0] == '/')
+                    snprintf(ctx->head_file, sizeof(ctx->head_file), "%s/HEAD", gitdir);
+                else
+                    snprintf(ctx->head_file, sizeof(ctx->head_file), "%s/%s/HEAD", dir, gitdir);
+            }
+            return;
+        }
+        char* slash = strrchr(dir, '/');
+        if (slash == NULL || strcmp(dir, "/") == 0)
+            return;
+        if (slash == dir)
+            slash[1] = '\0';
+        else
+            *slash = '\0';
+    }
+}
+
+// branch (or short commit) checked out in the repo containing ctx, "" if none
+const char* repo_head(DirContext* ctx) {
+    if (!ctx->repo_checked)
+        find_repo(ctx);
+    if (ctx->repo_root[0] == '\0')
+        return "";
+
+    struct stat st;
+    if (stat(ctx->head_file, &st) != 0) {
+        ctx->head[0] = '\0';
+        ctx->repo_checked = 0;  // repo went away; look again next time
+        ctx->repo_root[0] = '\0';
+        return "";
+    }
+    if (ctx->head[0] != '\0' && same_time(st.st_mtim, ctx->head_mtime))
+        return ctx->head;
+
+    char line[256] = "";
+    FILE* fp = fopen(ctx->head_file, "r");
+    if (fp != NULL) {
+        if (fgets(line, sizeof(line), fp) == NULL)
+            line[0] = '\0';
+        fclose(fp);
+    }
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "ref: refs/heads/", 16) == 0)
+        snprintf(ctx->head, sizeof(ctx->head), "%s", line + 16);
+    else
+        snprintf(ctx->head, sizeof(ctx->head), "%.7s", line);  // detached
+    ctx->head_mtime = st.st_mtim;
+    return ctx->head;
+}
+
+// prints the prompt: directory (with ~ for $HOME) and git branch
+void print_prompt() {
+    DirContext* ctx = cwd_context();
+    if (ctx == NULL) {
+        printf("> ");
+        return;
+    }
+    const char* home = getenv("HOME");
+    size_t home_len = home ? strlen(home) : 0;
+    if (home_len > 1 && strncmp(ctx->path, home, home_len) == 0 &&
+        (ctx->path[home_len] == '/' || ctx->path[home_len] == '\0'))
+        printf("~%s", ctx->path + home_len);
+    else
+        printf("%s", ctx->path);
+    const char* head = repo_head(ctx);
+    if (*head)
+        printf(" (%s)", head);
+    printf("> ");
+}
+
 // Function to display available built-in commands
 void display_help() {
     printf("Available built-in commands:\n");
-    printf("cd <directory>: Change the working directory.\n");
+    printf("cd <directory>: Change the working directory (cd - goes back, $CDPATH is searched).\n");
+    printf("pushd [directory], popd, dirs: Directory stack.\n");
     printf("exit: Terminate the shell.\n");
     printf("jobs: List currently running background processes.\n");
     printf("kill <job_number>: Terminate a background process.\n");
     printf("help: Display this help message.\n");
 }
 
-// Function to change the directory
-void change_directory(char *path) {
+// Function to change the directory; returns 0 on success
+int change_directory(char *path) {
+    char target[PATH_MAX * 2];
+    int print = 0;
+
+    if (path == NULL) {
+        path = getenv("HOME");
+        if (path == NULL) {
+            printf("cd: HOME not set\n");
+            return -1;
+        }
+    } else if (strcmp(path, "-") == 0) {
+        if (previous_dir[0] == '\0') {
+            printf("cd: no previous directory\n");
+            return -1;
+        }
+        path = strcpy(target, previous_dir);
+        print = 1;
+    } else if (path[0] != '/' && strncmp(path, "./", 2) != 0 && strncmp(path, "../", 3) != 0 &&
+               strcmp(path, ".") != 0 && strcmp(path, "..") != 0 && getenv("CDPATH") != NULL) {
+        // try each $CDPATH entry
+        char cdpath[PATH_MAX];
+        snprintf(cdpath, sizeof(cdpath), "%s", getenv("CDPATH"));
+        for (char* dir = strtok(cdpath, ":"); dir != NULL; dir = strtok(NULL, ":")) {
+            struct stat st;
+            snprintf(target, sizeof(target), "%s/%s", dir, path);
+            if (stat(target, &st) == 0 && S_ISDIR(st.st_mode)) {
+                path = target;
+                print = 1;
+                break;
+            }
+        }
+    }
+
+    DirContext* old = cwd_context();
     if (chdir(path) != 0) {
         perror("chdir failed");
+        return -1;
+    }
+    if (old != NULL)
+        snprintf(previous_dir, sizeof(previous_dir), "%s", old->path);
+
+    // the new directory's context: cached, or canonicalised once now
+    struct stat st;
+    if (stat(".", &st) == 0) {
+        current_dir = lookup_context(&st);
+        setenv("PWD", current_dir->path, 1);
+        if (previous_dir[0])
+            setenv("OLDPWD", previous_dir, 1);
+        if (print)
+            printf("%s\n", current_dir->path);
+    }
+    return 0;
+}
+
+// prints the directory stack, current directory first
+void print_dirs() {
+    DirContext* ctx = cwd_context();
+    printf("%s", ctx ? ctx->path : ".");
+    for (int i = dir_stack_count - 1; i >= 0; i--)
+        printf(" %s", dir_stack[i]);
+    printf("\n");
+}
+
+// pushd <dir> saves the current directory and changes to dir;
+// pushd with no argument swaps the current directory with the top of the stack
+void push_directory(char *path) {
+    DirContext* ctx = cwd_context();
+    if (ctx == NULL)
+        return;
+    if (path == NULL) {
+        if (dir_stack_count == 0) {
+            printf("pushd: no other directory\n");
+            return;
+        }
+        char* top = dir_stack[dir_stack_count - 1];
+        char* here = strdup(ctx->path);
+        if (change_directory(top) == 0) {
+            free(top);
+            dir_stack[dir_stack_count - 1] = here;
+            print_dirs();
+        } else {
+            free(here);
+        }
+        return;
+    }
+    if (dir_stack_count == MAX_DIR_STACK) {
+        printf("pushd: directory stack full\n");
+        return;
+    }
+    char* here = strdup(ctx->path);
+    if (change_directory(path) == 0) {
+        dir_stack[dir_stack_count++] = here;
+        print_dirs();
+    } else {
+        free(here);
+    }
+}
+
+void pop_directory() {
+    if (dir_stack_count == 0) {
+        printf("popd: directory stack empty\n");
+        return;
+    }
+    char* top = dir_stack[dir_stack_count - 1];
+    if (change_directory(top) == 0) {
+        dir_stack_count--;
+        free(top);
+        print_dirs();
     }
 }
 
@@ -73,6 +357,15 @@ int execute_builtin_command(char **args) {
     if (strcmp(args[0], "cd") == 0) {
         change_directory(args[1]);
         return 1;
+    } else if (strcmp(args[0], "pushd") == 0) {
+        push_directory(args[1]);
+        return 1;
+    } else if (strcmp(args[0], "popd") == 0) {
+        pop_directory();
+        return 1;
+    } else if (strcmp(args[0], "dirs") == 0) {
+        print_dirs();
+        return 1;
     } else if (strcmp(args[0], "exit") == 0) {
         exit(0);
     } else if (strcmp(args[0], "jobs") == 0) {
@@ -117,7 +410,8 @@ void shell_loop() {
     char *args[MAX_COMMAND_LENGTH / 2 + 1];
 
     while (1) {
-        printf("> ");
+        print_prompt();
+        fflush(stdout);
         if (!fgets(line, sizeof(line), stdin)) {  // read input usinf fgets
             break;
         }